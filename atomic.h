@@ -1359,4 +1359,16 @@ extern gint32 InterlockedExchangeAdd(volatile gint32 *dest, gint32 add);
 
 #endif
 
+#if !defined(__x86_64__) && defined(__GNUC__)
+static inline gint64 atomic64_cmpxchg(volatile gint64 *v, gint64 old, gint64 new)
+{
+	return __sync_val_compare_and_swap (v, old, new);
+}
+
+static inline gint64 atomic64_read (const volatile gint64 *v)
+{
+	return __sync_val_compare_and_swap ((volatile gint64*)v, 0, 0);
+}
+#endif
+
 #endif /* _WAPI_ATOMIC_H_ */
@@ -29,9 +29,15 @@ typedef unsigned long gulong;
 #ifdef __x86_64__
 typedef long gint64;
 typedef unsigned long guint64;
+#else
+typedef long long gint64;
+typedef unsigned long long guint64;
 #endif
 
 #define TRUE	1
 #define FALSE	0
 
+#define MIN(a,b)	((a) < (b) ? (a) : (b))
+#define MAX(a,b)	((a) > (b) ? (a) : (b))
+
 #endif
@@ -3,8 +3,21 @@
 #include <unistd.h>
 #include <errno.h>
 #include <stdio.h>
+#include <sys/syscall.h>
+#include <sched.h>
+
+#if defined(__linux__) && defined(__NR_membarrier)
+#include <linux/membarrier.h>
+#define HAVE_MEMBARRIER
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(MONO_SMR_NO_SIMD)
+#include <immintrin.h>
+#define HAVE_SIMD_HAZARD_SCAN
+#endif
 
 #include "mono-membar.h"
+#include "atomic.h"
 #include "delayed-free.h"
 #include "mono-mmap.h"
 #include "lock-free-array-queue.h"
@@ -16,14 +29,81 @@ typedef struct {
 	gpointer p;
 	MonoHazardousFreeFunc free_func;
 	gboolean might_lock;
+	/* Whether free_func puts p back into circulation. */
+	gboolean requeue;
+#ifdef MONO_SMR_EPOCH
+	/* The global epoch when the item was retired. */
+	guint32 epoch;
+#endif
+#ifdef MONO_SMR_ERAS
+	guint32 birth_era;
+	guint32 retire_era;
+#endif
 } DelayedFreeItem;
 
 static struct {
 	long long hazardous_pointer_count;
 } mono_stats;
 
+/*
+ * Every thread collects the pointers it retires in a private list.
+ * Once the list is longer than a threshold proportional to the number
+ * of hazard pointers, the thread takes a sorted snapshot of all
+ * hazard pointers and frees every item that is not in it.  Since no
+ * more items than there are hazard pointers can survive a scan, each
+ * scan frees at least as many items as it looked at hazard pointers,
+ * so the cost per retired item is constant.
+ *
+ * Items that are still hazardous when their thread exits go to the
+ * delayed free queue, from where scanning threads adopt them.
+ *
+ * Some items are not freed but requeued, like queue nodes, and a thread
+ * that goes idle must not keep them out of circulation.  They go into a
+ * second list that other threads can lock.  A thread that is about to
+ * allocate because it found nothing to reuse calls
+ * mono_thread_hazardous_scan_requeues (), which takes a single snapshot
+ * and requeues what it can from the requeue lists of all threads.
+ * While another thread has its requeue list locked, a thread retires
+ * such items to the delayed free queue instead.
+ *
+ * With MONO_SMR_EPOCH, a scan tries to advance the global epoch instead
+ * of taking a snapshot, and frees the items retired at least two epochs
+ * ago.  With MONO_SMR_ERAS, it advances the era clock and takes a
+ * snapshot of the reserved intervals instead of the hazard pointers.
+ */
+#define RETIRED_SCAN_FACTOR	2
+#define RETIRED_SCAN_MIN	16
+
+typedef struct {
+	DelayedFreeItem *items;
+	int count;
+	size_t size;
+} RetiredItems;
+
+typedef struct _RetiredList RetiredList;
+struct _RetiredList {
+	/* Only the owner thread touches these. */
+	RetiredItems items;
+	/* Other threads touch these while they have them locked. */
+	RetiredItems requeues;
+	/* The list of the thread that has the requeues locked, or NULL. */
+	RetiredList * volatile locked_by;
+	/* The sorted hazard pointers, or era intervals, of the last scan. */
+	gpointer snapshot;
+	size_t snapshot_size;
+	/*
+	 * Twice the items left after the last scan.  With epochs a
+	 * stalled thread can keep any number of items alive, and we
+	 * don't want to rescan them for every retire.
+	 */
+	int scan_at;
+	gboolean scanning;
+	gboolean exiting;
+};
+
 typedef struct {
 	int small_id;
+	RetiredList retired;
 } MonoInternalThread;
 
 static CRITICAL_SECTION small_id_mutex;
@@ -41,6 +121,9 @@ static MonoInternalThread **small_id_table = NULL;
 static volatile int hazard_table_size = 0;
 static MonoThreadHazardPointers * volatile hazard_table = NULL;
 
+/* The retired lists by small id.  Threads never give their ids back. */
+static RetiredList * volatile retired_lists [HAZARD_TABLE_MAX_SIZE];
+
 /* The table where we keep pointers to blocks to be freed but that
    have to wait because they're guarded by a hazard pointer. */
 static MonoLockFreeArrayQueue delayed_free_queue = MONO_LOCK_FREE_ARRAY_QUEUE_INIT (sizeof (DelayedFreeItem));
@@ -144,6 +227,8 @@ small_id_alloc (MonoInternalThread *thread)
 			hazard_table [id].hazard_pointers [i] = NULL;
 	}
 
+	retired_lists [id] = &thread->retired;
+
 	if (id > highest_small_id) {
 		highest_small_id = id;
 		mono_memory_write_barrier ();
@@ -163,26 +248,664 @@ small_id_free (int id)
 	small_id_table [id] = NULL;
 }
 
+/*
+ * Grows a buffer we got from mono_valloc () to at least `needed`
+ * bytes.  We don't use malloc () because retiring happens in lock-free
+ * contexts.
+ */
+static gpointer
+grow_buffer (gpointer buf, size_t *size, size_t needed)
+{
+	size_t new_size = *size ? *size : mono_pagesize ();
+	gpointer new_buf;
+
+	while (new_size < needed)
+		new_size *= 2;
+	if (new_size == *size)
+		return buf;
+
+	new_buf = buf ? mono_vremap (buf, *size, new_size) : NULL;
+	if (!new_buf) {
+		new_buf = mono_valloc (NULL, new_size, MONO_MMAP_READ | MONO_MMAP_WRITE);
+		g_assert (new_buf);
+		if (buf) {
+			memcpy (new_buf, buf, *size);
+			mono_vfree (buf, *size);
+		}
+	}
+
+	*size = new_size;
+	return new_buf;
+}
+
+static void
+retired_append (RetiredItems *list, DelayedFreeItem *item)
+{
+	size_t needed = (list->count + 1) * sizeof (DelayedFreeItem);
+
+	if (needed > list->size)
+		list->items = grow_buffer (list->items, &list->size, needed);
+	list->items [list->count++] = *item;
+}
+
+static void
+retired_free_items (RetiredItems *list)
+{
+	if (list->items)
+		mono_vfree (list->items, list->size);
+}
+
+/* Locks the requeues of `retired` for the thread with the list `self`. */
 static gboolean
-is_pointer_hazardous (gpointer p)
+retired_lock (RetiredList *retired, RetiredList *self)
+{
+	return InterlockedCompareExchangePointer ((gpointer volatile*)&retired->locked_by, self, NULL) == NULL;
+}
+
+static void
+retired_unlock (RetiredList *retired)
+{
+	mono_memory_write_barrier ();
+	retired->locked_by = NULL;
+}
+
+gboolean mono_thread_smr_asymmetric_fences = FALSE;
+
+/*
+ * The other side of mono_thread_smr_reader_barrier ().
+ */
+static void
+scanner_barrier (void)
+{
+#ifdef HAVE_MEMBARRIER
+	if (mono_thread_smr_asymmetric_fences) {
+		int result = syscall (__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0);
+		g_assert (result == 0);
+		return;
+	}
+#endif
+	mono_memory_barrier ();
+}
+
+#ifdef MONO_SMR_EPOCH
+/* The lowest bit is never set in the global epoch. */
+#define EPOCH_ACTIVE	1
+#define EPOCH_STEP	2
+
+/* Retired items can be freed once the global epoch is this far ahead. */
+#define EPOCH_SAFE_DISTANCE	(2 * EPOCH_STEP)
+
+/*
+ * Two scans advance the epoch past everything retired so far, the third
+ * one catches items the free functions retired.
+ */
+#define FREE_ALL_SCANS		3
+
+static volatile gint32 global_epoch = EPOCH_STEP;
+
+void
+mono_thread_smr_enter (MonoThreadHazardPointers *hp)
+{
+	if (hp->nesting++)
+		return;
+
+	hp->epoch = (guint32)global_epoch | EPOCH_ACTIVE;
+	/* Our epoch must be visible before we read shared pointers. */
+	mono_thread_smr_reader_barrier ();
+}
+
+void
+mono_thread_smr_leave (MonoThreadHazardPointers *hp)
+{
+	g_assert (hp->nesting > 0);
+	if (--hp->nesting)
+		return;
+
+	/* Like clearing a hazard pointer. */
+	mono_memory_write_barrier ();
+	hp->epoch = 0;
+}
+
+/*
+ * Advances the global epoch if all threads in critical regions have
+ * seen it.  Returns the global epoch.
+ */
+static guint32
+try_advance_epoch (void)
 {
-	int i, j;
+	guint32 epoch = (guint32)global_epoch;
 	int highest = highest_small_id;
+	int i;
 
 	g_assert (highest < hazard_table_size);
 
+	/* The retired items must be unlinked before we look. */
+	scanner_barrier ();
+
 	for (i = 0; i <= highest; ++i) {
-		for (j = 0; j < HAZARD_POINTER_COUNT; ++j) {
-			if (hazard_table [i].hazard_pointers [j] == p)
-				return TRUE;
-		}
+		guint32 thread_epoch = hazard_table [i].epoch;
+		if ((thread_epoch & EPOCH_ACTIVE) && thread_epoch != (epoch | EPOCH_ACTIVE))
+			return epoch;
+	}
+
+	InterlockedCompareExchange (&global_epoch, (gint32)(epoch + EPOCH_STEP), (gint32)epoch);
+
+	return (guint32)global_epoch;
+}
+#elif defined(MONO_SMR_ERAS)
+typedef struct {
+	guint32 lo;
+	/* The highest era reserved by this or any interval before it. */
+	guint32 hi;
+} EraInterval;
+
+/* The second scan catches items the free functions retired. */
+#define FREE_ALL_SCANS		2
+
+/* Era 0 means no reservation. */
+static volatile gint32 era_clock = 1;
+
+guint32
+mono_thread_hazardous_birth_era (void)
+{
+	return (guint32)era_clock;
+}
+
+void
+mono_thread_smr_enter (MonoThreadHazardPointers *hp)
+{
+	guint32 era;
+
+	if (hp->nesting++)
+		return;
+
+	/*
+	 * The scan reads era_hi first, so era_lo must be valid when it's
+	 * set.  If hazard pointers set outside the region still hold a
+	 * reservation, we extend it.
+	 */
+	era = (guint32)era_clock;
+	if (!hp->era_hi) {
+		hp->era_lo = era;
+		mono_memory_write_barrier ();
 	}
+	hp->era_hi = era;
+	/* Our reservation must be visible before we read shared pointers. */
+	mono_thread_smr_reader_barrier ();
+}
+
+void
+mono_thread_smr_leave (MonoThreadHazardPointers *hp)
+{
+	g_assert (hp->nesting > 0);
+	if (--hp->nesting)
+		return;
+
+	mono_thread_smr_release_reservation (hp);
+}
 
+/*
+ * Makes our reservation cover the current era.  Returns FALSE if it
+ * had to be extended, in which case the pointer must be read again.
+ * Outside a critical region this publishes a reservation that lasts
+ * until the last hazard pointer is cleared.
+ */
+static inline gboolean
+era_reserve_current (MonoThreadHazardPointers *hp)
+{
+	guint32 era = (guint32)era_clock;
+
+	if (hp->era_hi == era)
+		return TRUE;
+
+	if (!hp->era_hi) {
+		hp->era_lo = era;
+		mono_memory_write_barrier ();
+	}
+	hp->era_hi = era;
+	mono_thread_smr_reader_barrier ();
 	return FALSE;
 }
 
+static int
+compare_intervals (const void *a, const void *b)
+{
+	guint32 la = ((EraInterval*)a)->lo;
+	guint32 lb = ((EraInterval*)b)->lo;
+
+	if (la < lb)
+		return -1;
+	return la > lb;
+}
+
+/*
+ * Advances the era clock and copies the reservations of all threads in
+ * critical regions into the retired list's snapshot, sorted by their
+ * first era.  Returns their number.
+ */
+static int
+take_era_snapshot (RetiredList *retired)
+{
+	int highest = highest_small_id;
+	EraInterval *intervals;
+	int i, n = 0;
+
+	g_assert (highest < hazard_table_size);
+
+	retired->snapshot = grow_buffer (retired->snapshot, &retired->snapshot_size,
+			(highest + 1) * sizeof (EraInterval));
+	intervals = retired->snapshot;
+
+	/* Items retired from now on get a later era. */
+	InterlockedIncrement (&era_clock);
+
+	/* The retired items must be unlinked before we look. */
+	scanner_barrier ();
+
+	for (i = 0; i <= highest; ++i) {
+		guint32 hi = hazard_table [i].era_hi;
+		if (!hi)
+			continue;
+		mono_memory_read_barrier ();
+		intervals [n].lo = hazard_table [i].era_lo;
+		intervals [n].hi = hi;
+		++n;
+	}
+
+	qsort (intervals, n, sizeof (EraInterval), compare_intervals);
+	for (i = 1; i < n; ++i)
+		intervals [i].hi = MAX (intervals [i].hi, intervals [i - 1].hi);
+
+	return n;
+}
+
+/*
+ * Whether any of the reservations overlaps the lifetime of the item.
+ */
+static gboolean
+is_item_reserved (DelayedFreeItem *item, EraInterval *intervals, int n)
+{
+	int lo = 0, hi = n;
+
+	/* Find the number of intervals starting no later than the retirement. */
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (intervals [mid].lo <= item->retire_era)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo > 0 && intervals [lo - 1].hi >= item->birth_era;
+}
+#else
+#define FREE_ALL_SCANS		1
+#endif
+
+static int
+retired_scan_threshold (void)
+{
+	int threshold = (highest_small_id + 1) * HAZARD_POINTER_COUNT * RETIRED_SCAN_FACTOR;
+	return MAX (threshold, RETIRED_SCAN_MIN);
+}
+
+#ifndef MONO_SMR_CRITICAL_REGIONS
+/*
+ * Collecting the hazard pointers is the part of a scan that grows with
+ * the number of threads, and so is checking a single pointer in
+ * mono_thread_hazardous_try_free ().  Where the CPU lets us we look at
+ * four or eight slots at once, treating the hazard table as one array
+ * of slots.  Vector loads read each slot in a single access, just like
+ * the scalar loops.  Define MONO_SMR_NO_SIMD to always use the scalar
+ * versions.
+ */
+typedef int (*CollectHazardsFunc) (gpointer volatile *slots, int num_slots, gpointer *hazards);
+typedef gboolean (*FindHazardFunc) (gpointer volatile *slots, int num_slots, gpointer p);
+
+static int
+collect_hazards_scalar (gpointer volatile *slots, int num_slots, gpointer *hazards)
+{
+	int i, n = 0;
+
+	for (i = 0; i < num_slots; ++i) {
+		gpointer p = slots [i];
+		if (p)
+			hazards [n++] = p;
+	}
+
+	return n;
+}
+
+static gboolean
+find_hazard_scalar (gpointer volatile *slots, int num_slots, gpointer p)
+{
+	int i;
+
+	for (i = 0; i < num_slots; ++i) {
+		if (slots [i] == p)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+#ifdef HAVE_SIMD_HAZARD_SCAN
+__attribute__ ((target ("avx2")))
+static int
+collect_hazards_avx2 (gpointer volatile *slots, int num_slots, gpointer *hazards)
+{
+	int i, n = 0;
+
+	for (i = 0; i + 4 <= num_slots; i += 4) {
+		__m256i v = _mm256_loadu_si256 ((const __m256i*)&slots [i]);
+		gpointer lanes [4];
+		int mask;
+
+		if (_mm256_testz_si256 (v, v))
+			continue;
+
+		/* Take the pointers from the vector, not the slots, which might have changed. */
+		_mm256_storeu_si256 ((__m256i*)lanes, v);
+		mask = ~_mm256_movemask_pd (_mm256_castsi256_pd (_mm256_cmpeq_epi64 (v, _mm256_setzero_si256 ()))) & 0xf;
+		while (mask) {
+			hazards [n++] = lanes [__builtin_ctz (mask)];
+			mask &= mask - 1;
+		}
+	}
+
+	return n + collect_hazards_scalar (&slots [i], num_slots - i, &hazards [n]);
+}
+
+__attribute__ ((target ("avx512f")))
+static int
+collect_hazards_avx512 (gpointer volatile *slots, int num_slots, gpointer *hazards)
+{
+	int i, n = 0;
+
+	for (i = 0; i + 8 <= num_slots; i += 8) {
+		__m512i v = _mm512_loadu_si512 ((const void*)&slots [i]);
+		__mmask8 mask = _mm512_test_epi64_mask (v, v);
+
+		if (!mask)
+			continue;
+
+		_mm512_mask_compressstoreu_epi64 (&hazards [n], mask, v);
+		n += __builtin_popcount (mask);
+	}
+
+	return n + collect_hazards_scalar (&slots [i], num_slots - i, &hazards [n]);
+}
+
+__attribute__ ((target ("avx2")))
+static gboolean
+find_hazard_avx2 (gpointer volatile *slots, int num_slots, gpointer p)
+{
+	__m256i needle = _mm256_set1_epi64x ((long long)(gulong)p);
+	int i;
+
+	for (i = 0; i + 4 <= num_slots; i += 4) {
+		__m256i v = _mm256_loadu_si256 ((const __m256i*)&slots [i]);
+		if (_mm256_movemask_pd (_mm256_castsi256_pd (_mm256_cmpeq_epi64 (v, needle))))
+			return TRUE;
+	}
+
+	return find_hazard_scalar (&slots [i], num_slots - i, p);
+}
+
+__attribute__ ((target ("avx512f")))
+static gboolean
+find_hazard_avx512 (gpointer volatile *slots, int num_slots, gpointer p)
+{
+	__m512i needle = _mm512_set1_epi64 ((long long)(gulong)p);
+	int i;
+
+	for (i = 0; i + 8 <= num_slots; i += 8) {
+		__m512i v = _mm512_loadu_si512 ((const void*)&slots [i]);
+		if (_mm512_cmpeq_epi64_mask (v, needle))
+			return TRUE;
+	}
+
+	return find_hazard_scalar (&slots [i], num_slots - i, p);
+}
+#endif
+
+static CollectHazardsFunc collect_hazards = collect_hazards_scalar;
+static FindHazardFunc find_hazard = find_hazard_scalar;
+
+static void
+init_hazard_scan (void)
+{
+	/* The slots of all threads must form one array. */
+	g_assert (sizeof (MonoThreadHazardPointers) == HAZARD_POINTER_COUNT * sizeof (gpointer));
+
+#ifdef HAVE_SIMD_HAZARD_SCAN
+	__builtin_cpu_init ();
+	if (__builtin_cpu_supports ("avx512f")) {
+		collect_hazards = collect_hazards_avx512;
+		find_hazard = find_hazard_avx512;
+	} else if (__builtin_cpu_supports ("avx2")) {
+		collect_hazards = collect_hazards_avx2;
+		find_hazard = find_hazard_avx2;
+	}
+#endif
+}
+
+static int
+compare_pointers (const void *a, const void *b)
+{
+	gulong pa = (gulong)*(gpointer*)a;
+	gulong pb = (gulong)*(gpointer*)b;
+
+	if (pa < pb)
+		return -1;
+	return pa > pb;
+}
+
+/*
+ * Copies all non-NULL hazard pointers into the retired list's snapshot
+ * and sorts them.  Returns their number.
+ */
+static int
+take_hazard_snapshot (RetiredList *retired)
+{
+	int highest = highest_small_id;
+	gpointer *hazards;
+	int n;
+
+	g_assert (highest < hazard_table_size);
+
+	retired->snapshot = grow_buffer (retired->snapshot, &retired->snapshot_size,
+			(highest + 1) * HAZARD_POINTER_COUNT * sizeof (gpointer));
+	hazards = retired->snapshot;
+
+	/* The retired items must be unlinked before we look. */
+	scanner_barrier ();
+
+	n = collect_hazards ((gpointer volatile*)hazard_table, (highest + 1) * HAZARD_POINTER_COUNT, hazards);
+
+	qsort (hazards, n, sizeof (gpointer), compare_pointers);
+
+	return n;
+}
+#endif
+
+/*
+ * What a scan compares the retired items against.  The hazard pointers
+ * or era intervals are in the snapshot buffer of the scanning thread's
+ * list.
+ */
+typedef struct {
+#ifdef MONO_SMR_EPOCH
+	guint32 epoch;
+#else
+	gpointer data;
+	int n;
+#endif
+} ScanSnapshot;
+
+/*
+ * Takes a snapshot for checking the items retired so far.  This is the
+ * only place where a scan issues a scanner barrier.
+ */
+static void
+take_snapshot (RetiredList *retired, ScanSnapshot *snapshot)
+{
+#ifdef MONO_SMR_EPOCH
+	snapshot->epoch = try_advance_epoch ();
+#elif defined(MONO_SMR_ERAS)
+	snapshot->n = take_era_snapshot (retired);
+	snapshot->data = retired->snapshot;
+#else
+	snapshot->n = take_hazard_snapshot (retired);
+	snapshot->data = retired->snapshot;
+#endif
+}
+
+static gboolean
+is_item_hazardous (DelayedFreeItem *item, ScanSnapshot *snapshot)
+{
+#ifdef MONO_SMR_EPOCH
+	return snapshot->epoch - item->epoch < EPOCH_SAFE_DISTANCE;
+#elif defined(MONO_SMR_ERAS)
+	return is_item_reserved (item, snapshot->data, snapshot->n);
+#else
+	return bsearch (&item->p, snapshot->data, snapshot->n, sizeof (gpointer), compare_pointers) != NULL;
+#endif
+}
+
+/*
+ * Frees the items in `list` that `snapshot` shows are not hazardous.
+ * Returns the number of items freed.
+ */
+static int
+retired_filter (RetiredItems *list, ScanSnapshot *snapshot, gboolean lock_free_context)
+{
+	DelayedFreeItem item;
+	int i, num_scanned, num_kept;
+
+	num_scanned = list->count;
+	num_kept = 0;
+	for (i = 0; i < num_scanned; ++i) {
+		/*
+		 * Copy the item, because the free function might
+		 * retire more items and grow the list.
+		 */
+		item = list->items [i];
+
+		if (lock_free_context && item.might_lock) {
+			list->items [num_kept++] = item;
+			continue;
+		}
+		if (is_item_hazardous (&item, snapshot)) {
+			++mono_stats.hazardous_pointer_count;
+			list->items [num_kept++] = item;
+			continue;
+		}
+
+		item.free_func (item.p);
+	}
+
+	/* Move down the items that were retired while we scanned. */
+	memmove (&list->items [num_kept], &list->items [num_scanned],
+			(list->count - num_scanned) * sizeof (DelayedFreeItem));
+	list->count -= num_scanned - num_kept;
+
+	return num_scanned - num_kept;
+}
+
+/*
+ * Moves up to `max` items from the delayed free queue to the retired
+ * list, or all of them if `max` is negative.  The caller must have the
+ * requeues locked.
+ */
+static void
+retired_adopt (RetiredList *retired, int max)
+{
+	DelayedFreeItem item;
+	int i;
+
+	for (i = 0; max < 0 || i < max; ++i) {
+		if (!mono_lock_free_array_queue_pop (&delayed_free_queue, &item))
+			break;
+		retired_append (item.requeue ? &retired->requeues : &retired->items, &item);
+	}
+}
+
+/*
+ * Frees all items in the retired list that are not hazardous.  If
+ * `adopt_all` is set, all items in the delayed free queue are adopted
+ * first, otherwise only as many as make up a threshold.  If another
+ * thread has our requeues locked, we leave them and the delayed free
+ * queue alone.
+ */
+static void
+retired_scan (RetiredList *retired, gboolean lock_free_context, gboolean adopt_all)
+{
+	ScanSnapshot snapshot;
+	gboolean locked = FALSE;
+
+	g_assert (!retired->scanning);
+	retired->scanning = TRUE;
+
+	if (retired->locked_by != retired)
+		locked = retired_lock (retired, retired);
+	if (retired->locked_by == retired)
+		retired_adopt (retired, adopt_all ? -1 : retired_scan_threshold ());
+
+	take_snapshot (retired, &snapshot);
+	retired_filter (&retired->items, &snapshot, lock_free_context);
+	if (retired->locked_by == retired)
+		retired_filter (&retired->requeues, &snapshot, lock_free_context);
+
+	if (locked)
+		retired_unlock (retired);
+
+	retired->scan_at = 2 * (retired->items.count + retired->requeues.count);
+
+	retired->scanning = FALSE;
+}
+
 static pthread_key_t this_internal_thread_key;
 
+/*
+ * The destructor of this_internal_thread_key.  Items that are still
+ * hazardous are left to the other threads.
+ */
+static void
+thread_exit (void *data)
+{
+	MonoInternalThread *internal = data;
+	RetiredList *retired = &internal->retired;
+	int i;
+
+	if (retired->exiting)
+		return;
+
+	/* Wait for threads requeueing our items. */
+	while (!retired_lock (retired, retired))
+		sched_yield ();
+
+	retired_scan (retired, FALSE, FALSE);
+	for (i = 0; i < retired->items.count; ++i)
+		mono_lock_free_array_queue_push (&delayed_free_queue, &retired->items.items [i]);
+	for (i = 0; i < retired->requeues.count; ++i)
+		mono_lock_free_array_queue_push (&delayed_free_queue, &retired->requeues.items [i]);
+
+	retired_free_items (&retired->items);
+	retired_free_items (&retired->requeues);
+	if (retired->snapshot)
+		mono_vfree (retired->snapshot, retired->snapshot_size);
+	/* This also unlocks the list. */
+	memset (retired, 0, sizeof (RetiredList));
+	retired->exiting = TRUE;
+
+	/*
+	 * The destructors of other keys might still retire items,
+	 * which then go straight to the delayed free queue.
+	 */
+	pthread_setspecific (this_internal_thread_key, internal);
+}
+
 static MonoInternalThread*
 mono_thread_internal_current (void)
 {
@@ -228,7 +951,17 @@ get_hazardous_pointer (gpointer volatile *pp, MonoThreadHazardPointers *hp, int
 		/* Make it hazardous */
 		mono_hazard_pointer_set (hp, hazard_index, p);
 
-		mono_memory_barrier ();
+#if defined(MONO_SMR_EPOCH)
+		/* The critical region protects it already. */
+		break;
+#elif defined(MONO_SMR_ERAS)
+		/* So does the reservation, if it covers the current era. */
+		if (era_reserve_current (hp))
+			break;
+		continue;
+#endif
+
+		mono_thread_smr_reader_barrier ();
 
 		/* Check that it's still the same.  If not, try
 		   again. */
@@ -242,59 +975,264 @@ get_hazardous_pointer (gpointer volatile *pp, MonoThreadHazardPointers *hp, int
 	return p;
 }
 
+static void
+delayed_free_item_init (DelayedFreeItem *item, gpointer p, guint32 birth_era,
+		MonoHazardousFreeFunc free_func, gboolean free_func_might_lock)
+{
+	item->p = p;
+	item->free_func = free_func;
+	item->might_lock = free_func_might_lock;
+	item->requeue = FALSE;
+#ifdef MONO_SMR_EPOCH
+	item->epoch = (guint32)global_epoch;
+#endif
+#ifdef MONO_SMR_ERAS
+	item->birth_era = birth_era;
+	item->retire_era = (guint32)era_clock;
+#endif
+}
+
+/*
+ * Whether any thread might still be using `p`, which was born in
+ * `birth_era`.  With epochs we can't tell which pointers a thread uses,
+ * so every thread in a critical region might, including the caller.
+ */
 static gboolean
-try_free_delayed_free_item (gboolean lock_free_context)
+is_pointer_protected (gpointer p, guint32 birth_era)
+{
+	int highest = highest_small_id;
+#ifdef MONO_SMR_CRITICAL_REGIONS
+	int i;
+#endif
+#ifdef MONO_SMR_ERAS
+	guint32 retire_era = (guint32)era_clock;
+#endif
+
+	g_assert (highest < hazard_table_size);
+
+	/* The pointer must be unlinked before we look. */
+	mono_memory_barrier ();
+
+#if defined(MONO_SMR_EPOCH)
+	for (i = 0; i <= highest; ++i) {
+		if (hazard_table [i].epoch & EPOCH_ACTIVE)
+			return TRUE;
+	}
+	return FALSE;
+#elif defined(MONO_SMR_ERAS)
+	for (i = 0; i <= highest; ++i) {
+		guint32 hi = hazard_table [i].era_hi;
+		if (!hi)
+			continue;
+		mono_memory_read_barrier ();
+		if (hazard_table [i].era_lo <= retire_era && hi >= birth_era)
+			return TRUE;
+	}
+	return FALSE;
+#else
+	return find_hazard ((gpointer volatile*)hazard_table, (highest + 1) * HAZARD_POINTER_COUNT, p);
+#endif
+}
+
+/*
+ * Adds `item` to this thread's retired list and scans it if it's long
+ * enough.
+ */
+static void
+retire_item (DelayedFreeItem *item, gboolean lock_free_context)
+{
+	RetiredList *retired = &mono_thread_internal_current ()->retired;
+
+	if (retired->exiting) {
+		mono_lock_free_array_queue_push (&delayed_free_queue, item);
+		return;
+	}
+
+	if (!item->requeue) {
+		retired_append (&retired->items, item);
+	} else if (retired->locked_by == retired) {
+		/* Retired by a free function while we have them locked. */
+		retired_append (&retired->requeues, item);
+	} else if (retired_lock (retired, retired)) {
+		retired_append (&retired->requeues, item);
+		retired_unlock (retired);
+	} else {
+		/* Another thread is requeueing our items. */
+		mono_lock_free_array_queue_push (&delayed_free_queue, item);
+		return;
+	}
+
+	/* Free functions retiring more items don't scan recursively. */
+	if (!retired->scanning && retired->items.count + retired->requeues.count >= MAX (retired_scan_threshold (), retired->scan_at))
+		retired_scan (retired, lock_free_context, FALSE);
+}
+
+static void
+requeue_with_birth (gpointer p, guint32 birth_era, MonoHazardousFreeFunc free_func)
 {
 	DelayedFreeItem item;
-	gboolean popped = mono_lock_free_array_queue_pop (&delayed_free_queue, &item);
 
-	if (!popped)
-		return FALSE;
+	delayed_free_item_init (&item, p, birth_era, free_func, FALSE);
+	item.requeue = TRUE;
+	retire_item (&item, TRUE);
+}
+
+/*
+ * Retires `p` for a free function that puts it back into circulation,
+ * like requeueing a node.  Unlike other retired items, those are
+ * needed by other threads, so they don't only wait for the next scan
+ * of our list, but also for mono_thread_hazardous_scan_requeues ().
+ * `free_func` must be lock-free.
+ */
+void
+mono_thread_hazardous_requeue (gpointer p, MonoHazardousFreeFunc free_func)
+{
+	requeue_with_birth (p, 0, free_func);
+}
 
-	if ((lock_free_context && item.might_lock) || (is_pointer_hazardous (item.p))) {
-		mono_lock_free_array_queue_push (&delayed_free_queue, &item);
+/*
+ * Requeues the items of all threads that are no longer hazardous, with
+ * a single snapshot.  Meant for threads that are about to allocate
+ * because they found nothing to reuse.  Lists that other threads are
+ * working on are skipped.  Returns whether it made progress, so that
+ * the caller should look again and might call us again: whether it
+ * requeued anything or, with epochs, advanced the epoch, since items
+ * need two advances.
+ */
+gboolean
+mono_thread_hazardous_scan_requeues (void)
+{
+	RetiredList *self = &mono_thread_internal_current ()->retired;
+	int highest = highest_small_id;
+	ScanSnapshot snapshot;
+	int i, num_requeues, num_freed = 0;
+	gboolean progress = FALSE;
+
+	/* Free functions calling us don't scan recursively. */
+	if (self->exiting || self->scanning || !retired_lock (self, self))
 		return FALSE;
+	self->scanning = TRUE;
+
+	retired_adopt (self, retired_scan_threshold ());
+
+	/* The lists must be locked before the snapshot, so that nothing is appended after it. */
+	num_requeues = self->requeues.count;
+	for (i = 0; i <= highest; ++i) {
+		RetiredList *retired = retired_lists [i];
+		if (!retired || retired == self || !retired->requeues.count)
+			continue;
+		if (retired_lock (retired, self))
+			num_requeues += retired->requeues.count;
 	}
 
-	item.free_func (item.p);
+	if (num_requeues) {
+#ifdef MONO_SMR_EPOCH
+		guint32 epoch = (guint32)global_epoch;
+#endif
+		take_snapshot (self, &snapshot);
+		for (i = 0; i <= highest; ++i) {
+			RetiredList *retired = retired_lists [i];
+			if (retired && retired->locked_by == self)
+				num_freed += retired_filter (&retired->requeues, &snapshot, TRUE);
+		}
+		progress = num_freed > 0;
+#ifdef MONO_SMR_EPOCH
+		if (num_freed < num_requeues && snapshot.epoch != epoch)
+			progress = TRUE;
+#endif
+	}
+
+	for (i = 0; i <= highest; ++i) {
+		RetiredList *retired = retired_lists [i];
+		if (retired && retired != self && retired->locked_by == self)
+			retired_unlock (retired);
+	}
+	retired_unlock (self);
+
+	self->scanning = FALSE;
+
+	return progress;
+}
+
+/*
+ * Calls `free_func` on `p` right away unless some thread might still
+ * be using it, in which case it's requeued later, like with
+ * mono_thread_hazardous_requeue ().  Returns whether `p` was freed.
+ *
+ * This checks the hazard table for `p` alone, so it's only worth it
+ * for items that are rare and needed soon, like the dummies of a queue.
+ * With asymmetric fences only a membarrier would make the other
+ * threads' protections visible, which is too much for one pointer, so
+ * then `p` is always requeued.  `free_func` must be lock-free.
+ */
+gboolean
+mono_thread_hazardous_try_free (gpointer p, MonoHazardousFreeFunc free_func)
+{
+	return mono_thread_hazardous_try_free_with_birth (p, 0, free_func);
+}
 
-	return TRUE;
+/*
+ * Like mono_thread_hazardous_try_free (), with a birth era as for
+ * mono_thread_hazardous_free_or_queue_with_birth ().
+ */
+gboolean
+mono_thread_hazardous_try_free_with_birth (gpointer p, guint32 birth_era, MonoHazardousFreeFunc free_func)
+{
+	if (!mono_thread_smr_asymmetric_fences) {
+		if (!is_pointer_protected (p, birth_era)) {
+			free_func (p);
+			return TRUE;
+		}
+		++mono_stats.hazardous_pointer_count;
+	}
+
+	requeue_with_birth (p, birth_era, free_func);
+	return FALSE;
 }
 
 void
 mono_thread_hazardous_free_or_queue (gpointer p, MonoHazardousFreeFunc free_func,
 		gboolean free_func_might_lock, gboolean lock_free_context)
 {
-	int i;
+	mono_thread_hazardous_free_or_queue_with_birth (p, 0, free_func, free_func_might_lock, lock_free_context);
+}
+
+/*
+ * Like mono_thread_hazardous_free_or_queue (), but `birth_era` is what
+ * mono_thread_hazardous_birth_era () returned before `p` became
+ * reachable, which lets interval-based reclamation free it earlier.
+ */
+void
+mono_thread_hazardous_free_or_queue_with_birth (gpointer p, guint32 birth_era, MonoHazardousFreeFunc free_func,
+		gboolean free_func_might_lock, gboolean lock_free_context)
+{
+	DelayedFreeItem item;
 
 	if (lock_free_context)
 		g_assert (!free_func_might_lock);
 	if (free_func_might_lock)
 		g_assert (!lock_free_context);
 
-	/* First try to free a few entries in the delayed free
-	   table. */
-	for (i = 0; i < 3; ++i)
-		try_free_delayed_free_item (lock_free_context);
-
-	/* Now see if the pointer we're freeing is hazardous.  If it
-	   isn't, free it.  Otherwise put it in the delay list. */
-	if (is_pointer_hazardous (p)) {
-		DelayedFreeItem item = { p, free_func, free_func_might_lock };
-
-		++mono_stats.hazardous_pointer_count;
-
-		mono_lock_free_array_queue_push (&delayed_free_queue, &item);
-	} else {
-		free_func (p);
-	}
+	delayed_free_item_init (&item, p, birth_era, free_func, free_func_might_lock);
+	retire_item (&item, lock_free_context);
 }
 
+/*
+ * Frees the items retired by this thread and the ones left behind by
+ * exited threads, except those that are still hazardous.
+ */
 void
 mono_thread_hazardous_try_free_all (void)
 {
-	while (try_free_delayed_free_item (FALSE))
-		;
+	RetiredList *retired = &mono_thread_internal_current ()->retired;
+	int i;
+
+	/* Free functions calling us don't scan recursively. */
+	if (retired->exiting || retired->scanning)
+		return;
+
+	for (i = 0; i < FREE_ALL_SCANS; ++i)
+		retired_scan (retired, FALSE, TRUE);
 }
 
 void
@@ -303,11 +1241,35 @@ mono_thread_attach (void)
 	small_id_alloc (mono_thread_internal_current ());
 }
 
+/*
+ * Turns asymmetric fences on or off.  Returns whether they're on.  Not
+ * thread safe with respect to threads using hazard pointers.
+ */
+gboolean
+mono_thread_smr_set_asymmetric_fences (gboolean enable)
+{
+#ifdef HAVE_MEMBARRIER
+	static gboolean registered = FALSE;
+
+	if (enable && !registered) {
+		int commands = syscall (__NR_membarrier, MEMBARRIER_CMD_QUERY, 0);
+		if (commands >= 0 && (commands & MEMBARRIER_CMD_PRIVATE_EXPEDITED))
+			registered = syscall (__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0;
+	}
+	mono_thread_smr_asymmetric_fences = enable && registered;
+#endif
+
+	return mono_thread_smr_asymmetric_fences;
+}
+
 void
 mono_thread_smr_init (void)
 {
 	pthread_mutex_init (&small_id_mutex, NULL);
-	pthread_key_create (&this_internal_thread_key, NULL);
+	pthread_key_create (&this_internal_thread_key, thread_exit);
+#ifndef MONO_SMR_CRITICAL_REGIONS
+	init_hazard_scan ();
+#endif
 }
 
 void
@@ -10,33 +10,178 @@
 
 #include "mono-membar.h"
 
+/*
+ * Defining MONO_SMR_EPOCH switches from hazard pointers to epoch-based
+ * reclamation.  Threads then enter a critical region once per
+ * operation, with mono_thread_smr_enter (), and retired items are
+ * freed once the global epoch has advanced twice, which it can only
+ * do when every thread in a critical region has seen the current
+ * epoch.  The hazard pointer slots are still there, because the
+ * linked list set returns nodes in them, but setting them doesn't
+ * need barriers anymore.
+ *
+ * Defining MONO_SMR_ERAS switches to interval-based reclamation.  A
+ * global era clock advances as threads reclaim.  Threads in a critical
+ * region reserve the interval of eras between the one they entered in
+ * and the latest one they read a shared pointer in, extending it, with
+ * a barrier, only when the clock has moved.  Retired items remember the
+ * eras of their birth and retirement and are freed once their lifetime
+ * doesn't overlap any reservation, so a stalled thread only holds on to
+ * items that were alive during its interval.  Items retired without a
+ * birth era are treated as infinitely old, so callers can migrate to
+ * mono_thread_hazardous_free_or_queue_with_birth () one at a time.
+ * Likewise, get_hazardous_pointer () outside a critical region
+ * reserves the eras it reads in until the last hazard pointer is
+ * cleared, so readers can migrate to critical regions one at a time.
+ *
+ * The same code must be compiled for all schemes, so the data
+ * structures call mono_thread_smr_enter () and
+ * mono_thread_smr_leave (), which are no-ops with hazard pointers.
+ */
+
+#if defined(MONO_SMR_EPOCH) && defined(MONO_SMR_ERAS)
+#error "Only one of MONO_SMR_EPOCH and MONO_SMR_ERAS can be defined"
+#endif
+
+#if defined(MONO_SMR_EPOCH) || defined(MONO_SMR_ERAS)
+#define MONO_SMR_CRITICAL_REGIONS
+#endif
+
 #define HAZARD_POINTER_COUNT 3
 
 typedef struct {
 	gpointer hazard_pointers [HAZARD_POINTER_COUNT];
+#ifdef MONO_SMR_EPOCH
+	/* The global epoch when the thread entered, or 0 outside a critical region. */
+	volatile guint32 epoch;
+#endif
+#ifdef MONO_SMR_ERAS
+	/* The reserved eras.  era_hi is 0 if there is no reservation. */
+	volatile guint32 era_lo;
+	volatile guint32 era_hi;
+#endif
+#ifdef MONO_SMR_CRITICAL_REGIONS
+	int nesting;
+#endif
 } MonoThreadHazardPointers;
 
 typedef void (*MonoHazardousFreeFunc) (gpointer p);
 
+/*
+ * With asymmetric fences, readers only need a compiler barrier after
+ * publishing a hazard pointer, an epoch or an era, because threads
+ * scanning them first make every other thread of the process execute
+ * a full barrier, via membarrier (2).  They're off unless turned on
+ * with mono_thread_smr_set_asymmetric_fences (), because every scan
+ * then interrupts all other threads of the process.
+ */
+extern gboolean mono_thread_smr_asymmetric_fences;
+
+gboolean mono_thread_smr_set_asymmetric_fences (gboolean enable) MONO_INTERNAL;
+
+/*
+ * The barrier between publishing a protection and reading the pointer
+ * it protects.
+ */
+static inline void
+mono_thread_smr_reader_barrier (void)
+{
+	if (mono_thread_smr_asymmetric_fences)
+		__asm__ __volatile__ ("" : : : "memory");
+	else
+		mono_memory_barrier ();
+}
+
 void mono_thread_hazardous_free_or_queue (gpointer p, MonoHazardousFreeFunc free_func,
 		gboolean free_func_might_lock, gboolean lock_free_context) MONO_INTERNAL;
+void mono_thread_hazardous_free_or_queue_with_birth (gpointer p, guint32 birth_era, MonoHazardousFreeFunc free_func,
+		gboolean free_func_might_lock, gboolean lock_free_context) MONO_INTERNAL;
+gboolean mono_thread_hazardous_try_free (gpointer p, MonoHazardousFreeFunc free_func) MONO_INTERNAL;
+gboolean mono_thread_hazardous_try_free_with_birth (gpointer p, guint32 birth_era, MonoHazardousFreeFunc free_func) MONO_INTERNAL;
+void mono_thread_hazardous_requeue (gpointer p, MonoHazardousFreeFunc free_func) MONO_INTERNAL;
+gboolean mono_thread_hazardous_scan_requeues (void) MONO_INTERNAL;
 void mono_thread_hazardous_try_free_all (void) MONO_INTERNAL;
 MonoThreadHazardPointers* mono_hazard_pointer_get (void) MONO_INTERNAL;
 gpointer get_hazardous_pointer (gpointer volatile *pp, MonoThreadHazardPointers *hp, int hazard_index) MONO_INTERNAL;
 
+#ifdef MONO_SMR_CRITICAL_REGIONS
+#define mono_hazard_pointer_set(hp,i,v)	\
+	do { g_assert ((i) >= 0 && (i) < HAZARD_POINTER_COUNT); \
+		(hp)->hazard_pointers [(i)] = (v); \
+	} while (0)
+#else
 #define mono_hazard_pointer_set(hp,i,v)	\
 	do { g_assert ((i) >= 0 && (i) < HAZARD_POINTER_COUNT); \
 		(hp)->hazard_pointers [(i)] = (v); \
 		mono_memory_write_barrier (); \
 	} while (0)
+#endif
 
 #define mono_hazard_pointer_get_val(hp,i)	\
 	((hp)->hazard_pointers [(i)])
 
+#ifdef MONO_SMR_ERAS
+/*
+ * Drops the reservation of a thread outside a critical region once it
+ * has no hazard pointers left.
+ */
+static inline void
+mono_thread_smr_release_reservation (MonoThreadHazardPointers *hp)
+{
+	int i;
+
+	if (hp->nesting || !hp->era_hi)
+		return;
+	for (i = 0; i < HAZARD_POINTER_COUNT; ++i) {
+		if (hp->hazard_pointers [i])
+			return;
+	}
+
+	/* Like clearing a hazard pointer. */
+	mono_memory_write_barrier ();
+	hp->era_hi = 0;
+}
+
+#define mono_hazard_pointer_clear(hp,i)	\
+	do { g_assert ((i) >= 0 && (i) < HAZARD_POINTER_COUNT); \
+		(hp)->hazard_pointers [(i)] = NULL; \
+		mono_thread_smr_release_reservation ((hp)); \
+	} while (0)
+#else
 #define mono_hazard_pointer_clear(hp,i)	\
 	do { g_assert ((i) >= 0 && (i) < HAZARD_POINTER_COUNT); \
 		(hp)->hazard_pointers [(i)] = NULL; \
 	} while (0)
+#endif
+
+#ifdef MONO_SMR_ERAS
+guint32 mono_thread_hazardous_birth_era (void) MONO_INTERNAL;
+#else
+/*
+ * The era to pass as the birth of an item that is about to become
+ * reachable.
+ */
+static inline guint32
+mono_thread_hazardous_birth_era (void)
+{
+	return 0;
+}
+#endif
+
+#ifdef MONO_SMR_CRITICAL_REGIONS
+void mono_thread_smr_enter (MonoThreadHazardPointers *hp) MONO_INTERNAL;
+void mono_thread_smr_leave (MonoThreadHazardPointers *hp) MONO_INTERNAL;
+#else
+static inline void
+mono_thread_smr_enter (MonoThreadHazardPointers *hp)
+{
+}
+
+static inline void
+mono_thread_smr_leave (MonoThreadHazardPointers *hp)
+{
+}
+#endif
 
 void mono_thread_attach (void);
 
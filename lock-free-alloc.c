@@ -39,7 +39,9 @@
  * descriptor before it can allocate from its superblock.  While it owns
  * the descriptor no other thread can acquire and hence allocate from
  * it.  A consequence of this is that the ABA problem cannot occur, so
- * we don't need the tag field and don't have to use 64 bit CAS.
+ * we don't need the tag field.  We still use a 64 bit CAS on the
+ * anchor, though, so that its avail and count fields are wide enough
+ * for the slot counts of large superblocks.
  *
  * Descriptors are stored in two locations: The partial queue and the
  * active field.  They can only be in at most one of those at one time.
@@ -73,14 +75,81 @@
  * concurrency, however: We don't point from slots to descriptors.
  * Instead we allocate superblocks aligned and point from the start of
  * the superblock to the descriptor, so we only need one word of
- * metadata per superblock.
+ * metadata per superblock.  Each size class has its own superblock
+ * size, so to find the start of the superblock for a slot we keep a
+ * map from pages to the sizes of the superblocks they belong to.
  *
- * FIXME: Having more than one allocator per size class is probably
- * buggy because it was never tested.
+ * Slots of a new superblock are not linked into its free list up
+ * front.  Instead the anchor has a bump index: slots below it have
+ * been handed out at least once, slots from it to the end of the
+ * superblock never have been and are allocated by incrementing it.
+ * Only freed slots go into the free list, so the number of slots in
+ * the list is the anchor's count minus the number of slots above the
+ * bump index, and a superblock's memory is only touched as far as it
+ * is used.
+ *
+ * Trimming gives the memory of free slots back to the OS.  Free slots
+ * right below the bump index are moved back above it by lowering it.
+ * In addition, the superblock is divided into 64 chunks of at least a
+ * page, and a descriptor has a bitmap of the chunks that lie entirely
+ * within runs of free slots.  Free slots that start in those chunks
+ * are trimmed: they are neither in the free list nor above the bump
+ * index, and are only handed out once all other free slots are gone.
+ * Trimmed slots never carry links, so the OS can take the chunks'
+ * pages until the slots are used again, and nothing depends on what
+ * they read as after that.  Only a thread that owns the descriptor
+ * touches its trimmed chunks.
+ *
+ * A size class can be put into remote free mode.  Every descriptor
+ * then remembers the thread that last allocated from it, and slots
+ * freed by other threads are pushed onto a separate list in the
+ * descriptor instead of into its anchor.  The allocating thread takes
+ * that whole list with a single CAS when the anchor runs out of slots.
+ * A descriptor that becomes FULL is not referenced by anybody, so slots
+ * on its remote list would be lost: that's why a thread that makes a
+ * descriptor FULL checks the remote list afterwards, and a thread that
+ * pushes onto the remote list checks afterwards whether the descriptor
+ * is FULL.  At least one of them sees the other and frees the remote
+ * list the normal way.
+ *
+ * The partial queue of a size class can be split into bins by how
+ * full the superblocks are.  A descriptor goes into the bin for its
+ * count at the time it is enqueued, and allocation takes from the
+ * fullest bin first, so the emptiest superblocks are left alone long
+ * enough to become EMPTY and be retired.  Frees never move a queued
+ * descriptor to another bin, so the binning is only approximate.
+ *
+ * Each bin can further be split into stripes, so that threads that
+ * run out of active descriptors don't all hit the head and tail of the
+ * same queue.  A thread enqueues into the stripe its identity hashes
+ * to and dequeues from it first, but falls back to the other stripes
+ * of the bin before it moves on to the next bin, so a descriptor is
+ * never stranded in a stripe nobody looks at.
+ *
+ * Objects too large for any size class get their own mapping, which
+ * is also marked in that map, so mono_lock_free_free () can tell them
+ * apart from slots.
+ *
+ * More than one allocator can share a size class, and hence its
+ * partial queue.  A descriptor's heap is the allocator that last took
+ * ownership of it, so it's the one whose active field the descriptor
+ * can be in.  A free only ever uses the heap to try to take the
+ * descriptor out of, or put it into, that active field, and to find
+ * the partial queue, which is the same for all heaps.  The owner sets
+ * the heap before it updates the anchor, so a free that makes the
+ * descriptor empty after that sees the right heap, and an earlier one
+ * leaves it to the owner, which then finds it empty.
+ * The per-CPU heaps make use of this: each CPU has its own active
+ * descriptor, and a CPU whose heap and partial queue run dry steals
+ * the active descriptors of the other CPUs before it allocates a new
+ * superblock.
  */
 
 #include "fake-glib.h"
 #include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "mono-mmap.h"
 #include "mono-membar.h"
@@ -88,144 +157,621 @@
 #include "atomic.h"
 #include "lock-free-queue.h"
 #include "sgen-gc.h"
+#include "mono-cpu.h"
+#include "mono-backoff.h"
 
 #include "lock-free-alloc.h"
 
 //#define DESC_AVAIL_DUMMY
+/*
+ * Gives each group of descriptor fields its own cache line, so that
+ * CASes on the anchor don't invalidate the fields every alloc and free
+ * reads.  That can only pay off with several CPUs.  It has only been
+ * measured on one, without cache miss counters, where the free
+ * benchmark is slower with it, so it's off by default.
+ */
+//#define DESC_SPLIT_LINES
 
 enum {
-	STATE_FULL,
-	STATE_PARTIAL,
-	STATE_EMPTY
+	STATE_FULL = MONO_LOCK_FREE_ALLOC_SB_FULL,
+	STATE_PARTIAL = MONO_LOCK_FREE_ALLOC_SB_PARTIAL,
+	STATE_EMPTY = MONO_LOCK_FREE_ALLOC_SB_EMPTY
 };
 
 typedef union {
-	gint32 value;
+	gint64 value;
 	struct {
-		guint32 avail : 15;
-		guint32 count : 15;
-		guint32 state : 2;
+		guint64 avail : 20;
+		guint64 count : 20;
+		guint64 bump : 20;
+		guint64 state : 2;
 	} data;
 } Anchor;
 
+/* The value of avail, and of the last link, if the free list is empty. */
+#define AVAIL_NONE	0xfffff
+
+/* The number of free slots in the free list, i.e. not above the bump index or trimmed. */
+#define ANCHOR_NUM_LISTED(a,d)	((a).data.count - ((d)->max_count - (a).data.bump) - (d)->num_trimmed)
+
+/* Slots freed by threads other than the owner, linked like the free list. */
+typedef union {
+	gint64 value;
+	struct {
+		guint64 head : 20;
+		guint64 tail : 20;
+		guint64 count : 20;
+	} data;
+} RemoteList;
+
+#ifdef DESC_SPLIT_LINES
+#define DESC_LINE	__attribute__ ((aligned (MONO_LOCK_FREE_ALLOC_CACHE_LINE_SIZE)))
+#else
+#define DESC_LINE
+#endif
+
+/*
+ * The fields are grouped by how they are accessed.  With
+ * DESC_SPLIT_LINES each group gets its own cache line, so that the
+ * CASes on the anchor by every alloc and free don't invalidate the
+ * line with the fields every alloc and free reads.  The node must come
+ * first because we cast queue nodes to descriptors.
+ */
 typedef struct _MonoLockFreeAllocDescriptor Descriptor;
 struct _MonoLockFreeAllocDescriptor {
+	/* Used by the partial queue, the free lists and the owner. */
 	MonoLockFreeQueueNode node;
-	MonoLockFreeAllocator *heap;
-	volatile Anchor anchor;
-	unsigned int slot_size;
-	unsigned int max_count;
-	gpointer sb;
 #ifndef DESC_AVAIL_DUMMY
+	/* Links free descriptors within a chunk, and chunks on the stack. */
 	Descriptor * volatile next;
+	Descriptor * volatile next_chunk;
 #endif
+	/*
+	 * Odd while the descriptor is not in use or being set up, see
+	 * the heap walk.
+	 */
+	volatile gint32 generation;
+	/*
+	 * The trimmed chunks and the number of trimmed slots, only
+	 * accessed by the owner.
+	 */
+	guint64 trimmed;
+	unsigned int num_trimmed;
+	/* The last trimming pass that saw the descriptor. */
+	gint32 trim_pass;
 	gboolean in_use;	/* used for debugging only */
+
+	/* Set up with the superblock and read by every alloc and free. */
+	MonoLockFreeAllocator *heap DESC_LINE;
+	gpointer sb;
+	unsigned int slot_size;
+	unsigned int sb_size;
+	unsigned int max_count;
+	/* The thread that allocated from it last, only written if it changes. */
+	pthread_t owner;
+
+	volatile Anchor anchor DESC_LINE;
+
+	/* Pushed onto by remote frees. */
+	volatile RemoteList remote DESC_LINE;
 };
 
 #define NUM_DESC_BATCH	64
 
-#define SB_SIZE		16384
-#define SB_HEADER_SIZE	16
-#define SB_USABLE_SIZE	(SB_SIZE - SB_HEADER_SIZE)
+/*
+ * Descriptors are allocated in batches, which are never freed, so the
+ * heap walk can look at them at any time.
+ */
+typedef struct _DescBatch DescBatch;
+struct _DescBatch {
+	DescBatch *next;
+	Descriptor descs [NUM_DESC_BATCH];
+};
+
+static DescBatch * volatile desc_batches;
+
+#ifdef MONO_LOCK_FREE_ALLOC_STATS
+static MonoLockFreeAllocStats* thread_stats (MonoLockFreeAllocSizeClass *sc);
+#define STAT_ADD(sc,field,n)	(thread_stats ((sc))->field += (n))
+#else
+#define STAT_ADD(sc,field,n)	do { } while (0)
+#endif
+#define STAT_INC(sc,field)	STAT_ADD ((sc), field, 1)
+
+#define SB_MIN_SIZE	MONO_LOCK_FREE_ALLOC_SB_MIN_SIZE
+#define SB_MAX_SIZE	MONO_LOCK_FREE_ALLOC_SB_MAX_SIZE
+#define SB_HEADER_SIZE	MONO_LOCK_FREE_ALLOC_SB_HEADER_SIZE
+#define SB_USABLE_SIZE(s)	MONO_LOCK_FREE_ALLOC_SB_USABLE_SIZE (s)
+
+/*
+ * The superblock map.
+ *
+ * For every page (of SB_MIN_SIZE bytes) that belongs to a superblock
+ * it stores the base 2 logarithm of the superblock's size, so that we
+ * can find the superblock header, and hence the descriptor, for any
+ * slot address.  The first page of a large object is marked with
+ * SB_MAP_LARGE.  It's a two level radix tree with a statically
+ * allocated root.  Leaves are allocated on demand and never freed.
+ * Entries are only written by the thread that allocates or frees the
+ * superblock, and only read for slots within live superblocks, so no
+ * synchronization beyond publishing the leaves is needed.
+ */
+
+#if defined(__x86_64__) || defined(__LP64__)
+#define SB_MAP_ADDRESS_BITS	48
+#else
+#define SB_MAP_ADDRESS_BITS	32
+#endif
+#define SB_MAP_PAGE_SHIFT	12
+#define SB_MAP_PAGE_BITS	(SB_MAP_ADDRESS_BITS - SB_MAP_PAGE_SHIFT)
+#define SB_MAP_LEAF_BITS	((SB_MAP_PAGE_BITS + 1) / 2)
+#define SB_MAP_ROOT_BITS	(SB_MAP_PAGE_BITS - SB_MAP_LEAF_BITS)
+#define SB_MAP_LEAF_SIZE	(1 << SB_MAP_LEAF_BITS)
+
+#define SB_MAP_LARGE		0xff
+
+static guint8 * volatile sb_map [1 << SB_MAP_ROOT_BITS];
+
+static guint8*
+sb_map_leaf (gpointer addr, gboolean create)
+{
+	gulong page = (gulong)addr >> SB_MAP_PAGE_SHIFT;
+	gulong root_index = page >> SB_MAP_LEAF_BITS;
+	guint8 *leaf;
+
+	g_assert (root_index < (1 << SB_MAP_ROOT_BITS));
+
+	leaf = sb_map [root_index];
+	if (leaf || !create)
+		return leaf;
+
+	leaf = mono_sgen_alloc_os_memory (SB_MAP_LEAF_SIZE, TRUE);
+	g_assert (leaf);
+	if (InterlockedCompareExchangePointer ((gpointer * volatile)&sb_map [root_index], leaf, NULL) != NULL) {
+		mono_sgen_free_os_memory (leaf, SB_MAP_LEAF_SIZE);
+		leaf = sb_map [root_index];
+	}
+	return leaf;
+}
+
+static void
+sb_map_set (gpointer sb_header, unsigned int sb_size, guint8 value)
+{
+	/* Superblocks are aligned to their size, so they never span two leaves. */
+	guint8 *leaf = sb_map_leaf (sb_header, TRUE);
+	gulong page = ((gulong)sb_header >> SB_MAP_PAGE_SHIFT) & (SB_MAP_LEAF_SIZE - 1);
+
+	memset (leaf + page, value, sb_size >> SB_MAP_PAGE_SHIFT);
+}
+
+static guint8
+sb_map_get (gpointer addr)
+{
+	guint8 *leaf = sb_map_leaf (addr, FALSE);
+	guint8 bits;
+
+	g_assert (leaf);
+	bits = leaf [((gulong)addr >> SB_MAP_PAGE_SHIFT) & (SB_MAP_LEAF_SIZE - 1)];
+	g_assert (bits);
+
+	return bits;
+}
+
+static gpointer
+sb_header_for_bits (gpointer addr, guint8 bits)
+{
+	g_assert (bits != SB_MAP_LARGE);
+	return (gpointer)((gulong)addr & ~(((gulong)1 << bits) - 1));
+}
 
-#define SB_HEADER_FOR_ADDR(a)	((gpointer)((gulong)(a) & ~(gulong)(SB_SIZE-1)))
+#define SB_HEADER_FOR_ADDR(a)	(sb_header_for_bits ((a), sb_map_get ((a))))
 #define DESCRIPTOR_FOR_ADDR(a)	(*(Descriptor**)SB_HEADER_FOR_ADDR (a))
 
+/*
+ * The superblock cache.
+ *
+ * Retired superblocks are not unmapped right away but kept in a cache
+ * shared by all size classes, with one bucket per superblock size, up
+ * to a high-water mark of SB_CACHE_MAX_BYTES in total.  New superblocks
+ * are taken from the cache if possible.
+ *
+ * A superblock that has been in the cache for longer than the decay
+ * interval is unmapped by the next decay pass, which any thread that
+ * retires or allocates a superblock runs at most once per interval.
+ * Size classes in auto trim mode are trimmed after a decay pass, but
+ * not by the pass itself, because trimming dequeues partial
+ * descriptors and the thread that runs the pass might be in the
+ * middle of handling one.  Frees do it instead, one descriptor per
+ * free, so no single free pays for trimming the whole heap.  Idle
+ * programs can call mono_lock_free_allocator_decay_sb_cache ().
+ *
+ * Like the large object cache, a bucket is an array of entries which
+ * are only CASed between NULL and a superblock, and a superblock is
+ * only accessed by whoever took it out of the array.  Cached
+ * superblocks keep their superblock map entries.  The time a
+ * superblock entered the cache is stored in its header, after the
+ * descriptor pointer.
+ */
+
+#define SB_CACHE_DEFAULT_MAX_BYTES	(8 * 1024 * 1024)
+#define SB_CACHE_DEFAULT_DECAY_MS	1000
+
+#define SB_CACHE_MIN_SIZE_BITS	12
+#define SB_CACHE_BUCKETS	10
+#define SB_CACHE_SLOTS		256
+
+#define SB_CACHE_TIME(h)	(*(gint64*)((char*)(h) + sizeof (gint64)))
+
+typedef struct {
+	gpointer volatile slots [SB_CACHE_SLOTS];
+	/* Approximate, so that empty buckets are not searched. */
+	volatile gint32 count;
+} SbCacheBucket;
+
+static SbCacheBucket sb_cache [SB_CACHE_BUCKETS];
+static volatile gint32 sb_cache_bytes;
+static volatile gint32 sb_cache_max_bytes = SB_CACHE_DEFAULT_MAX_BYTES;
+static volatile gint32 sb_cache_decay_ms = SB_CACHE_DEFAULT_DECAY_MS;
+static volatile gint64 sb_cache_last_decay;
+/* Set by a decay pass, for frees to trim. */
+static volatile gint32 auto_trim_pending;
+
+static gint64
+now_ms (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (gint64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static SbCacheBucket*
+sb_cache_bucket (unsigned int sb_size)
+{
+	int bits = __builtin_ctz (sb_size);
+	g_assert (bits >= SB_CACHE_MIN_SIZE_BITS && bits - SB_CACHE_MIN_SIZE_BITS < SB_CACHE_BUCKETS);
+	return &sb_cache [bits - SB_CACHE_MIN_SIZE_BITS];
+}
+
+static void
+sb_unmap (gpointer sb_header, unsigned int sb_size)
+{
+	sb_map_set (sb_header, sb_size, 0);
+	mono_sgen_free_os_memory (sb_header, sb_size);
+	//g_print ("free sb %p\n", sb_header);
+}
+
+static gpointer
+sb_cache_get (unsigned int sb_size)
+{
+	SbCacheBucket *bucket = sb_cache_bucket (sb_size);
+	int i;
+
+	if (bucket->count <= 0)
+		return NULL;
+
+	for (i = 0; i < SB_CACHE_SLOTS; ++i) {
+		gpointer sb_header = bucket->slots [i];
+		if (sb_header && InterlockedCompareExchangePointer (&bucket->slots [i], NULL, sb_header) == sb_header) {
+			InterlockedDecrement (&bucket->count);
+			InterlockedExchangeAdd (&sb_cache_bytes, -(gint32)sb_size);
+			return sb_header;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Puts a superblock that is already accounted for in SB_CACHE_BYTES
+ * into a free entry of its bucket.
+ */
+static gboolean
+sb_cache_insert (SbCacheBucket *bucket, gpointer sb_header)
+{
+	int i;
+
+	for (i = 0; i < SB_CACHE_SLOTS; ++i) {
+		if (!bucket->slots [i] && InterlockedCompareExchangePointer (&bucket->slots [i], sb_header, NULL) == NULL) {
+			InterlockedIncrement (&bucket->count);
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static gboolean
+sb_cache_put (gpointer sb_header, unsigned int sb_size, gint64 now)
+{
+	if (InterlockedExchangeAdd (&sb_cache_bytes, sb_size) + (gint32)sb_size > sb_cache_max_bytes)
+		goto fail;
+
+	SB_CACHE_TIME (sb_header) = now;
+	if (sb_cache_insert (sb_cache_bucket (sb_size), sb_header))
+		return TRUE;
+
+ fail:
+	InterlockedExchangeAdd (&sb_cache_bytes, -(gint32)sb_size);
+	return FALSE;
+}
+
+/*
+ * Unmaps all cached superblocks that have been in the cache for at
+ * least MIN_AGE milliseconds.
+ */
+static void
+sb_cache_release (gint64 now, gint64 min_age)
+{
+	int b, i;
+
+	for (b = 0; b < SB_CACHE_BUCKETS; ++b) {
+		SbCacheBucket *bucket = &sb_cache [b];
+		unsigned int sb_size = 1 << (b + SB_CACHE_MIN_SIZE_BITS);
+
+		if (bucket->count <= 0)
+			continue;
+
+		for (i = 0; i < SB_CACHE_SLOTS; ++i) {
+			gpointer sb_header = bucket->slots [i];
+			if (!sb_header || InterlockedCompareExchangePointer (&bucket->slots [i], NULL, sb_header) != sb_header)
+				continue;
+			InterlockedDecrement (&bucket->count);
+
+			/* It's ours now, so we can look at it. */
+			if (now - SB_CACHE_TIME (sb_header) < min_age && sb_cache_insert (bucket, sb_header))
+				continue;
+
+			InterlockedExchangeAdd (&sb_cache_bytes, -(gint32)sb_size);
+			sb_unmap (sb_header, sb_size);
+		}
+	}
+}
+
+static void auto_trim_step (void);
+static void large_cache_release (gint64 now, gint64 min_age);
+
+/*
+ * Runs a decay pass if the last one was at least an interval ago and
+ * no other thread beats us to it.
+ */
+static void
+sb_cache_maybe_decay (gint64 now)
+{
+	gint64 last = sb_cache_last_decay;
+
+	if (now - last < sb_cache_decay_ms)
+		return;
+	if (atomic64_cmpxchg (&sb_cache_last_decay, last, now) != last)
+		return;
+
+	sb_cache_release (now, sb_cache_decay_ms);
+	large_cache_release (now, sb_cache_decay_ms);
+	auto_trim_pending = 1;
+}
+
+/*
+ * Returns the address of the first slot, SLOT_OFFSET bytes from the
+ * start of the superblock.
+ */
 static gpointer
-alloc_sb (Descriptor *desc)
+alloc_sb (Descriptor *desc, unsigned int slot_offset)
 {
-	gpointer sb_header = mono_sgen_alloc_os_memory_aligned (SB_SIZE, SB_SIZE, TRUE);
-	g_assert (sb_header == SB_HEADER_FOR_ADDR (sb_header));
-	DESCRIPTOR_FOR_ADDR (sb_header) = desc;
+	unsigned int sb_size = desc->sb_size;
+	gpointer sb_header = sb_cache_get (sb_size);
+
+	sb_cache_maybe_decay (now_ms ());
+
+	if (!sb_header) {
+		sb_header = mono_sgen_alloc_os_memory_aligned (sb_size, sb_size, TRUE);
+		g_assert (!((gulong)sb_header & (sb_size - 1)));
+		sb_map_set (sb_header, sb_size, __builtin_ctz (sb_size));
+	}
+	*(Descriptor**)sb_header = desc;
 	//g_print ("sb %p for %p\n", sb_header, desc);
-	return (char*)sb_header + SB_HEADER_SIZE;
+	return (char*)sb_header + slot_offset;
 }
 
 static void
-free_sb (gpointer sb)
+free_sb (gpointer sb, unsigned int sb_size)
 {
-	gpointer sb_header = SB_HEADER_FOR_ADDR (sb);
-	g_assert ((char*)sb_header + SB_HEADER_SIZE == sb);
-	mono_sgen_free_os_memory (sb_header, SB_SIZE);
-	//g_print ("free sb %p\n", sb_header);
+	gpointer sb_header = (gpointer)((gulong)sb & ~(gulong)(sb_size - 1));
+	gint64 now = now_ms ();
+
+	if (!sb_cache_put (sb_header, sb_size, now))
+		sb_unmap (sb_header, sb_size);
+
+	sb_cache_maybe_decay (now);
 }
 
 #ifndef DESC_AVAIL_DUMMY
+/*
+ * Free descriptors are kept in per-thread caches, which are refilled
+ * from and drained to a global stack of chunks of up to
+ * DESC_CHUNK_SIZE descriptors.  A thread that finds both its cache
+ * and the stack empty maps a new batch, keeps one chunk of it and
+ * pushes the others, so racing threads never throw batches away.
+ *
+ * Only the head of a chunk is ever the head of the stack, and a
+ * descriptor only becomes the head of a chunk on the stack after a
+ * hazardous free, so popping a chunk can't suffer from ABA.
+ */
+
+#define DESC_CHUNK_SIZE	16
+
+typedef struct {
+	Descriptor *head;
+	int count;
+} DescCache;
+
+static DescCache* thread_desc_cache (gboolean create);
+
 static Descriptor * volatile desc_avail;
 
+static void
+desc_push_chunk (gpointer _chunk)
+{
+	static MonoBackoffSite backoff_site;
+	Descriptor *chunk = _chunk;
+	Descriptor *old_head;
+	MonoBackoff backoff;
+
+	mono_backoff_init (&backoff, &backoff_site);
+	for (;;) {
+		old_head = desc_avail;
+		chunk->next_chunk = old_head;
+		mono_memory_write_barrier ();
+		if (InterlockedCompareExchangePointer ((gpointer * volatile)&desc_avail, chunk, old_head) == old_head)
+			break;
+		mono_backoff_once (&backoff);
+	}
+	mono_backoff_done (&backoff);
+}
+
 static Descriptor*
-desc_alloc (void)
+desc_pop_chunk (void)
 {
+	static MonoBackoffSite backoff_site;
 	MonoThreadHazardPointers *hp = mono_hazard_pointer_get ();
-	Descriptor *desc;
+	MonoBackoff backoff;
+	Descriptor *chunk;
 
+	mono_thread_smr_enter (hp);
+	mono_backoff_init (&backoff, &backoff_site);
 	for (;;) {
-		gboolean success;
+		chunk = get_hazardous_pointer ((gpointer * volatile)&desc_avail, hp, 1);
+		if (!chunk)
+			break;
+		if (InterlockedCompareExchangePointer ((gpointer * volatile)&desc_avail, chunk->next_chunk, chunk) == chunk)
+			break;
+		mono_hazard_pointer_clear (hp, 1);
+		mono_backoff_once (&backoff);
+	}
+	mono_hazard_pointer_clear (hp, 1);
+	mono_thread_smr_leave (hp);
+	mono_backoff_done (&backoff);
 
-		desc = get_hazardous_pointer ((gpointer * volatile)&desc_avail, hp, 1);
-		if (desc) {
-			Descriptor *next = desc->next;
-			success = (InterlockedCompareExchangePointer ((gpointer * volatile)&desc_avail, next, desc) == desc);
-		} else {
-			size_t desc_size = sizeof (Descriptor);
-			Descriptor *d;
-			int i;
-
-			desc = mono_sgen_alloc_os_memory (desc_size * NUM_DESC_BATCH, TRUE);
-
-			/* Organize into linked list. */
-			d = desc;
-			for (i = 0; i < NUM_DESC_BATCH; ++i) {
-				Descriptor *next = (i == (NUM_DESC_BATCH - 1)) ? NULL : (Descriptor*)((char*)desc + ((i + 1) * desc_size));
-				d->next = next;
-				mono_lock_free_queue_node_init (&d->node, TRUE);
-				d = next;
-			}
+	return chunk;
+}
 
-			mono_memory_write_barrier ();
+/*
+ * Maps a new batch and pushes all but its first chunk, which is
+ * returned.
+ */
+static Descriptor*
+desc_new_batch (void)
+{
+	DescBatch *batch = mono_sgen_alloc_os_memory (sizeof (DescBatch), TRUE);
+	DescBatch *head;
+	int i;
+
+	g_assert (batch);
+	for (i = 0; i < NUM_DESC_BATCH; ++i) {
+		Descriptor *d = &batch->descs [i];
+		d->next = ((i + 1) % DESC_CHUNK_SIZE == 0 || i == NUM_DESC_BATCH - 1) ? NULL : &batch->descs [i + 1];
+		d->generation = 1;
+		mono_lock_free_queue_node_init (&d->node, TRUE);
+	}
 
-			success = (InterlockedCompareExchangePointer ((gpointer * volatile)&desc_avail, desc->next, NULL) == NULL);
+	mono_memory_write_barrier ();
 
-			if (!success)
-				mono_sgen_free_os_memory (desc, desc_size * NUM_DESC_BATCH);
-		}
+	do {
+		head = desc_batches;
+		batch->next = head;
+		mono_memory_write_barrier ();
+	} while (InterlockedCompareExchangePointer ((gpointer * volatile)&desc_batches, batch, head) != head);
 
-		mono_hazard_pointer_clear (hp, 1);
+	/* Nobody can have a hazard pointer to fresh descriptors. */
+	for (i = DESC_CHUNK_SIZE; i < NUM_DESC_BATCH; i += DESC_CHUNK_SIZE)
+		desc_push_chunk (&batch->descs [i]);
 
-		if (success)
-			break;
+	return &batch->descs [0];
+}
+
+static Descriptor*
+desc_alloc (void)
+{
+	DescCache *cache = thread_desc_cache (TRUE);
+	Descriptor *desc;
+
+	if (!cache->head) {
+		desc = desc_pop_chunk ();
+		if (!desc)
+			desc = desc_new_batch ();
+		cache->head = desc;
+		for (cache->count = 0; desc; desc = desc->next)
+			++cache->count;
 	}
 
+	desc = cache->head;
+	cache->head = desc->next;
+	--cache->count;
+
 	g_assert (!desc->in_use);
 	desc->in_use = TRUE;
 
 	return desc;
 }
 
+/*
+ * Pushes all but KEEP descriptors of CACHE onto the stack, in chunks.
+ */
+static void
+desc_cache_drain (DescCache *cache, int keep)
+{
+	while (cache->count > keep) {
+		int n = MIN (cache->count - keep, DESC_CHUNK_SIZE);
+		Descriptor *chunk = cache->head;
+		Descriptor *last = chunk;
+		int i;
+
+		for (i = 1; i < n; ++i)
+			last = last->next;
+		cache->head = last->next;
+		cache->count -= n;
+		last->next = NULL;
+
+		/* The head might have been the head of a chunk before. */
+		mono_thread_hazardous_requeue (chunk, desc_push_chunk);
+	}
+}
+
 static void
 desc_enqueue_avail (gpointer _desc)
 {
 	Descriptor *desc = _desc;
-	Descriptor *old_head;
+	DescCache *cache;
 
 	g_assert (desc->anchor.data.state == STATE_EMPTY);
 	g_assert (!desc->in_use);
 
-	do {
-		old_head = desc_avail;
-		desc->next = old_head;
-		mono_memory_write_barrier ();
-	} while (InterlockedCompareExchangePointer ((gpointer * volatile)&desc_avail, desc, old_head) != old_head);
+	/*
+	 * We're called after a hazardous free, so the descriptor can
+	 * go onto the stack right away if we have no cache.
+	 */
+	cache = thread_desc_cache (FALSE);
+	if (!cache) {
+		desc->next = NULL;
+		desc_push_chunk (desc);
+		return;
+	}
+
+	desc->next = cache->head;
+	cache->head = desc;
+	if (++cache->count >= 2 * DESC_CHUNK_SIZE)
+		desc_cache_drain (cache, DESC_CHUNK_SIZE);
 }
 
 static void
 desc_retire (Descriptor *desc)
 {
 	g_assert (desc->anchor.data.state == STATE_EMPTY);
+	g_assert (!desc->remote.data.count);
 	g_assert (desc->in_use);
+	STAT_INC (desc->heap->sc, sb_retires);
 	desc->in_use = FALSE;
-	free_sb (desc->sb);
-	mono_thread_hazardous_free_or_queue (desc, desc_enqueue_avail, FALSE, TRUE);
+	InterlockedIncrement (&desc->generation);
+	free_sb (desc->sb, desc->sb_size);
+	mono_thread_hazardous_requeue (desc, desc_enqueue_avail);
 }
 #else
 MonoLockFreeQueue available_descs;
@@ -238,56 +784,135 @@ desc_alloc (void)
 	if (desc)
 		return desc;
 
-	return calloc (1, sizeof (Descriptor));
+	if (posix_memalign ((void**)&desc, MONO_LOCK_FREE_ALLOC_CACHE_LINE_SIZE, sizeof (Descriptor)))
+		return NULL;
+	memset (desc, 0, sizeof (Descriptor));
+	return desc;
 }
 
 static void
 desc_retire (Descriptor *desc)
 {
-	free_sb (desc->sb);
+	STAT_INC (desc->heap->sc, sb_retires);
+	free_sb (desc->sb, desc->sb_size);
 	mono_lock_free_queue_enqueue (&available_descs, &desc->node);
 }
 #endif
 
+static void desc_reclaim_remote (Descriptor *desc);
+static void desc_reclaim_remote_owned (Descriptor *desc);
+static void desc_untrim (Descriptor *desc);
+
+#define PARTIAL_QUEUE(sc,bin,stripe)	(&(sc)->partial [(bin)] [(stripe)].data.queue)
+#define PARTIAL_COUNT(sc,bin,stripe)	((sc)->partial [(bin)] [(stripe)].data.count)
+
+/* The stripe the current thread prefers. */
+static unsigned int
+partial_stripe (MonoLockFreeAllocSizeClass *sc)
+{
+	/* Thread handles are far apart, so we mix up their bits. */
+	guint64 hash = (guint64)(gulong)pthread_self () * 0x9e3779b97f4a7c15ULL;
+	return (unsigned int)(hash >> 32) % sc->num_partial_stripes;
+}
+
+static Descriptor*
+partial_dequeue (MonoLockFreeAllocSizeClass *sc, unsigned int bin, unsigned int stripe)
+{
+	Descriptor *desc = (Descriptor*) mono_lock_free_queue_dequeue (PARTIAL_QUEUE (sc, bin, stripe));
+	if (desc)
+		InterlockedDecrement (&PARTIAL_COUNT (sc, bin, stripe));
+	return desc;
+}
+
 static Descriptor*
 list_get_partial (MonoLockFreeAllocSizeClass *sc)
 {
-	for (;;) {
-		Descriptor *desc = (Descriptor*) mono_lock_free_queue_dequeue (&sc->partial);
-		if (!desc)
-			return NULL;
-		if (desc->anchor.data.state != STATE_EMPTY)
-			return desc;
-		desc_retire (desc);
+	unsigned int num_stripes = sc->num_partial_stripes;
+	unsigned int home = partial_stripe (sc);
+	unsigned int bin, i;
+
+	for (bin = 0; bin < sc->num_partial_bins; ++bin) {
+		for (i = 0; i < num_stripes; ++i) {
+			unsigned int stripe = (home + i) % num_stripes;
+			for (;;) {
+				Descriptor *desc = partial_dequeue (sc, bin, stripe);
+				if (!desc)
+					break;
+				/* All its slots might have been freed remotely. */
+				if (desc->remote.data.count)
+					desc_reclaim_remote_owned (desc);
+				if (desc->anchor.data.state != STATE_EMPTY) {
+					STAT_INC (sc, partial_gets);
+					return desc;
+				}
+				desc_retire (desc);
+			}
+		}
 	}
+
+	return NULL;
+}
+
+/* Bin 0 is for the fullest descriptors. */
+static unsigned int
+desc_partial_bin (Descriptor *desc)
+{
+	unsigned int num_bins = desc->heap->sc->num_partial_bins;
+	unsigned int count = desc->anchor.data.count;
+
+	if (count >= desc->max_count)
+		return num_bins - 1;
+	return (count - 1) * num_bins / desc->max_count;
 }
 
 static void
 desc_put_partial (gpointer _desc)
 {
 	Descriptor *desc = _desc;
+	MonoLockFreeAllocSizeClass *sc = desc->heap->sc;
+	unsigned int bin, stripe;
 
 	g_assert (desc->anchor.data.state != STATE_FULL);
 
+	bin = desc_partial_bin (desc);
+	stripe = partial_stripe (sc);
 	mono_lock_free_queue_node_free (&desc->node);
-	mono_lock_free_queue_enqueue (&desc->heap->sc->partial, &desc->node);
+	InterlockedIncrement (&PARTIAL_COUNT (sc, bin, stripe));
+	mono_lock_free_queue_enqueue (PARTIAL_QUEUE (sc, bin, stripe), &desc->node);
 }
 
 static void
 list_put_partial (Descriptor *desc)
 {
 	g_assert (desc->anchor.data.state != STATE_FULL);
-	mono_thread_hazardous_free_or_queue (desc, desc_put_partial, FALSE, TRUE);
+	STAT_INC (desc->heap->sc, partial_puts);
+	mono_thread_hazardous_requeue (desc, desc_put_partial);
 }
 
+/*
+ * Empty descriptors are most likely in the bin for the emptiest ones,
+ * so that's where we start.
+ */
 static void
 list_remove_empty_desc (MonoLockFreeAllocSizeClass *sc)
 {
 	int num_non_empty = 0;
+	unsigned int num_stripes = sc->num_partial_stripes;
+	unsigned int home = partial_stripe (sc);
+	int bin = sc->num_partial_bins - 1;
+	unsigned int i = 0;
 	for (;;) {
-		Descriptor *desc = (Descriptor*) mono_lock_free_queue_dequeue (&sc->partial);
-		if (!desc)
-			return;
+		Descriptor *desc = partial_dequeue (sc, bin, (home + i) % num_stripes);
+		if (!desc) {
+			if (++i < num_stripes)
+				continue;
+			i = 0;
+			if (--bin < 0)
+				return;
+			continue;
+		}
+		if (desc->remote.data.count)
+			desc_reclaim_remote_owned (desc);
 		/*
 		 * We don't need to read atomically because we're the
 		 * only thread that references this descriptor.
@@ -296,17 +921,38 @@ list_remove_empty_desc (MonoLockFreeAllocSizeClass *sc)
 			desc_retire (desc);
 		} else {
 			g_assert (desc->heap->sc == sc);
-			mono_thread_hazardous_free_or_queue (desc, desc_put_partial, FALSE, TRUE);
+			STAT_INC (sc, partial_puts);
+			mono_thread_hazardous_requeue (desc, desc_put_partial);
 			if (++num_non_empty >= 2)
 				return;
 		}
 	}
 }
 
+static Descriptor*
+heap_steal_active (MonoLockFreeAllocator *heap)
+{
+	MonoLockFreeAllocPerCpu *per_cpu = heap->per_cpu;
+	int start = (MonoLockFreeAllocCpuHeap*)heap - per_cpu->heaps;
+	int i;
+
+	for (i = 1; i < per_cpu->num_heaps; ++i) {
+		MonoLockFreeAllocator *victim = &per_cpu->heaps [(start + i) % per_cpu->num_heaps].heap;
+		Descriptor *desc = victim->active;
+		if (desc && InterlockedCompareExchangePointer ((gpointer * volatile)&victim->active, NULL, desc) == desc)
+			return desc;
+	}
+
+	return NULL;
+}
+
 static Descriptor*
 heap_get_partial (MonoLockFreeAllocator *heap)
 {
-	return list_get_partial (heap->sc);
+	Descriptor *desc = list_get_partial (heap->sc);
+	if (!desc && heap->per_cpu)
+		desc = heap_steal_active (heap);
+	return desc;
 }
 
 static void
@@ -315,179 +961,1558 @@ heap_put_partial (Descriptor *desc)
 	list_put_partial (desc);
 }
 
+/*
+ * Backs off with BACKOFF if the CAS fails, so callers can retry right
+ * away.
+ */
 static gboolean
-set_anchor (Descriptor *desc, Anchor old_anchor, Anchor new_anchor)
+set_anchor (Descriptor *desc, Anchor old_anchor, Anchor new_anchor, MonoBackoff *backoff)
 {
 	if (old_anchor.data.state == STATE_EMPTY)
 		g_assert (new_anchor.data.state == STATE_EMPTY);
 
-	return InterlockedCompareExchange (&desc->anchor.value, new_anchor.value, old_anchor.value) == old_anchor.value;
+	if (atomic64_cmpxchg (&desc->anchor.value, old_anchor.value, new_anchor.value) == old_anchor.value) {
+		mono_backoff_done (backoff);
+		return TRUE;
+	}
+
+	STAT_INC (desc->heap->sc, anchor_cas_retries);
+	mono_backoff_once (backoff);
+	return FALSE;
 }
 
-static gpointer
-alloc_from_active_or_partial (MonoLockFreeAllocator *heap)
-{
+/*
+ * Allocates up to N slots from a single descriptor, with a single
+ * anchor update.  Returns the number of slots allocated, which is 0
+ * only if there is neither an active nor a partial descriptor.
+ */
+static int
+alloc_from_active_or_partial (MonoLockFreeAllocator *heap, gpointer *ptrs, int n)
+{
+	static MonoBackoffSite active_backoff_site, anchor_backoff_site;
 	Descriptor *desc;
 	Anchor old_anchor, new_anchor;
+	MonoBackoff backoff;
+	int i, k;
+
+	mono_backoff_init (&backoff, &active_backoff_site);
+ retry:
+	desc = heap->active;
+	if (desc) {
+		if (InterlockedCompareExchangePointer ((gpointer * volatile)&heap->active, NULL, desc) != desc) {
+			STAT_INC (heap->sc, active_cas_failures);
+			mono_backoff_once (&backoff);
+			goto retry;
+		}
+		mono_backoff_done (&backoff);
+	} else {
+		desc = heap_get_partial (heap);
+		if (!desc)
+			return 0;
+	}
+
+	/* Now we own the desc. */
+	if (!pthread_equal (desc->owner, pthread_self ()))
+		desc->owner = pthread_self ();
+	if (desc->heap != heap)
+		desc->heap = heap;
+
+	if (desc->remote.data.count && desc->anchor.data.count < n)
+		desc_reclaim_remote (desc);
+
+	if (desc->num_trimmed)
+		desc_untrim (desc);
+
+	mono_backoff_init (&backoff, &anchor_backoff_site);
+	do {
+		unsigned int next, bump, num_listed;
+
+		new_anchor.value = old_anchor.value = atomic64_read (&desc->anchor.value);
+		if (old_anchor.data.state == STATE_EMPTY) {
+			/* We must free it because we own it. */
+			desc_retire (desc);
+			mono_backoff_init (&backoff, &active_backoff_site);
+			goto retry;
+		}
+		g_assert (old_anchor.data.state == STATE_PARTIAL);
+		g_assert (old_anchor.data.count > 0);
+
+		/* Trimmed slots are only handed out after desc_untrim (). */
+		k = MIN (n, old_anchor.data.count - desc->num_trimmed);
+		g_assert (k > 0);
+
+		mono_memory_read_barrier ();
+
+		/*
+		 * Frees only ever push onto the head of the list, so
+		 * nobody else can change the links we follow here
+		 * while we own the descriptor.
+		 */
+		next = old_anchor.data.avail;
+		num_listed = ANCHOR_NUM_LISTED (old_anchor, desc);
+		for (i = 0; i < k && i < num_listed; ++i) {
+			gpointer addr = (char*)desc->sb + next * desc->slot_size;
+			ptrs [i] = addr;
+			next = *(unsigned int*)addr;
+			g_assert (next < desc->max_count || next == AVAIL_NONE);
+		}
+
+		/* Then the never used part. */
+		bump = old_anchor.data.bump;
+		for (; i < k; ++i) {
+			g_assert (bump < desc->max_count);
+			ptrs [i] = (char*)desc->sb + bump++ * desc->slot_size;
+		}
+
+		new_anchor.data.avail = next;
+		new_anchor.data.bump = bump;
+		new_anchor.data.count -= k;
+
+		if (new_anchor.data.count == 0)
+			new_anchor.data.state = STATE_FULL;
+	} while (!set_anchor (desc, old_anchor, new_anchor, &backoff));
+
+	/* If the desc is partial we have to give it back. */
+	if (new_anchor.data.state == STATE_PARTIAL) {
+		if (InterlockedCompareExchangePointer ((gpointer * volatile)&heap->active, desc, NULL) != NULL)
+			heap_put_partial (desc);
+	} else if (desc->remote.data.count) {
+		/*
+		 * Remote frees that came in before we made it FULL
+		 * might not have seen it FULL.  The CAS above is a
+		 * full barrier, so we see their pushes.
+		 */
+		desc_reclaim_remote (desc);
+	}
+
+	return k;
+}
+
+static int
+alloc_from_new_sb (MonoLockFreeAllocator *heap, gpointer *ptrs, int n)
+{
+	unsigned int slot_size, count, i, k;
+	Descriptor *desc = desc_alloc ();
+
+	desc->sb_size = heap->sc->sb_size;
+	desc->sb = alloc_sb (desc, heap->sc->slot_offset);
+	STAT_INC (heap->sc, sb_allocs);
+
+	slot_size = heap->sc->slot_size;
+	count = (desc->sb_size - heap->sc->slot_offset) / slot_size;
+	k = MIN (n, count - 1);
+
+	desc->heap = heap;
+	desc->owner = pthread_self ();
+	desc->remote.value = 0;
+	/*
+	 * Setting bump to k because 0 to k - 1 are the blocks we're
+	 * allocating right away.  The slots are carved off lazily, so
+	 * the free list starts out empty.
+	 */
+	desc->anchor.data.avail = AVAIL_NONE;
+	desc->anchor.data.bump = k;
+	desc->trimmed = 0;
+	desc->num_trimmed = 0;
+	desc->trim_pass = 0;
+	desc->slot_size = heap->sc->slot_size;
+	desc->max_count = count;
+
+	desc->anchor.data.count = desc->max_count - k;
+	desc->anchor.data.state = STATE_PARTIAL;
+
+	mono_memory_write_barrier ();
+	/* The descriptor is now set up for the heap walk. */
+	InterlockedIncrement (&desc->generation);
+
+	for (i = 0; i < k; ++i)
+		ptrs [i] = (char*)desc->sb + i * slot_size;
+
+	/*
+	 * Make it active.  If another thread beat us to it we still
+	 * keep our slots and give the rest of the superblock to the
+	 * partial queue, so racing threads don't waste superblocks.
+	 */
+	if (InterlockedCompareExchangePointer ((gpointer * volatile)&heap->active, desc, NULL) != NULL) {
+		STAT_INC (heap->sc, active_cas_failures);
+		heap_put_partial (desc);
+	}
+
+	return k;
+}
+
+static void
+alloc_slots (MonoLockFreeAllocator *heap, gpointer *ptrs, int n)
+{
+	while (n > 0) {
+		int k = alloc_from_active_or_partial (heap, ptrs, n);
+		/* Descriptors waiting to be requeued might have free slots. */
+		while (!k && mono_thread_hazardous_scan_requeues ())
+			k = alloc_from_active_or_partial (heap, ptrs, n);
+		if (!k)
+			k = alloc_from_new_sb (heap, ptrs, n);
+		ptrs += k;
+		n -= k;
+	}
+}
+
+static gpointer
+alloc_slot (MonoLockFreeAllocator *heap)
+{
 	gpointer addr;
+	alloc_slots (heap, &addr, 1);
+	return addr;
+}
+
+#define SLOT_INDEX(d,p)	((unsigned int)(((char*)(p) - (char*)(d)->sb) / (d)->slot_size))
+#define SLOT_ADDR(d,i)	((gpointer)((char*)(d)->sb + (i) * (d)->slot_size))
+
+/*
+ * Links the slots PTRS [0] to PTRS [N - 1], which must all belong to
+ * DESC, in the order in which they're given.  The last link is not
+ * set.
+ */
+static void
+link_slots (Descriptor *desc, gpointer *ptrs, int n)
+{
+	gpointer sb = desc->sb;
+	int i;
+
+	for (i = 0; i < n; ++i) {
+		g_assert ((char*)ptrs [i] >= (char*)sb && (char*)ptrs [i] < (char*)sb + desc->max_count * desc->slot_size);
+		if (i > 0)
+			*(unsigned int*)ptrs [i - 1] = SLOT_INDEX (desc, ptrs [i]);
+	}
+}
+
+/*
+ * Returns a list of N linked slots, starting with the slot with index
+ * FIRST and ending with LAST, to DESC with a single anchor update.
+ */
+static void
+free_chain (Descriptor *desc, unsigned int first, gpointer last, int n)
+{
+	static MonoBackoffSite backoff_site;
+	Anchor old_anchor, new_anchor;
+	MonoLockFreeAllocator *heap = NULL;
+	MonoBackoff backoff;
+
+	mono_backoff_init (&backoff, &backoff_site);
+	do {
+		new_anchor.value = old_anchor.value = atomic64_read (&desc->anchor.value);
+		*(unsigned int*)last = old_anchor.data.avail;
+		new_anchor.data.avail = first;
+		g_assert (new_anchor.data.avail < desc->max_count);
+
+		if (old_anchor.data.state == STATE_FULL)
+			new_anchor.data.state = STATE_PARTIAL;
+
+		new_anchor.data.count += n;
+		g_assert (new_anchor.data.count <= desc->max_count);
+		if (new_anchor.data.count == desc->max_count) {
+			heap = desc->heap;
+			new_anchor.data.state = STATE_EMPTY;
+		}
+	} while (!set_anchor (desc, old_anchor, new_anchor, &backoff));
+
+	if (new_anchor.data.state == STATE_EMPTY) {
+		g_assert (old_anchor.data.state != STATE_EMPTY);
+
+		if (old_anchor.data.state == STATE_FULL) {
+			/*
+			 * A batch can take a descriptor from FULL to
+			 * EMPTY.  Nobody owned it, so now we do.
+			 */
+			desc_retire (desc);
+		} else if (InterlockedCompareExchangePointer ((gpointer * volatile)&heap->active, NULL, desc) == desc) {
+			/*
+			 * We own it, so we free it.  In the meantime,
+			 * though, another thread might have retired it
+			 * and it might have been reused for a new
+			 * superblock that became active again, in
+			 * which case we have to give it back.
+			 */
+			if (desc->anchor.data.state == STATE_EMPTY)
+				desc_retire (desc);
+			else if (InterlockedCompareExchangePointer ((gpointer * volatile)&heap->active, desc, NULL) != NULL)
+				heap_put_partial (desc);
+		} else {
+			/*
+			 * Somebody else must free it, so we do some
+			 * freeing for others.
+			 */
+			list_remove_empty_desc (heap->sc);
+		}
+	} else if (old_anchor.data.state == STATE_FULL) {
+		/*
+		 * Nobody owned it, now we do, so we need to give it
+		 * back.
+		 */
+
+		g_assert (new_anchor.data.state == STATE_PARTIAL);
+
+		if (InterlockedCompareExchangePointer ((gpointer * volatile)&desc->heap->active, desc, NULL) != NULL)
+			heap_put_partial (desc);
+	}
+}
+
+/*
+ * Takes the whole remote list of DESC.  Returns FALSE if it is empty.
+ */
+static gboolean
+remote_take (Descriptor *desc, RemoteList *list)
+{
+	static MonoBackoffSite backoff_site;
+	RemoteList old_list;
+	MonoBackoff backoff;
+
+	mono_backoff_init (&backoff, &backoff_site);
+	for (;;) {
+		old_list.value = atomic64_read (&desc->remote.value);
+		if (!old_list.data.count)
+			return FALSE;
+		if (atomic64_cmpxchg (&desc->remote.value, old_list.value, 0) == old_list.value)
+			break;
+		mono_backoff_once (&backoff);
+	}
+	mono_backoff_done (&backoff);
+
+	*list = old_list;
+	return TRUE;
+}
+
+/*
+ * Moves the remote list of DESC to its free list.  This works whether
+ * or not we own DESC, and like any free might retire it or give it back.
+ */
+static void
+desc_reclaim_remote (Descriptor *desc)
+{
+	RemoteList list;
+
+	if (remote_take (desc, &list))
+		free_chain (desc, list.data.head, SLOT_ADDR (desc, list.data.tail), list.data.count);
+}
+
+/*
+ * Moves the remote list of DESC, which we own and which is neither
+ * active nor in a partial queue, to its free list.  If that makes it
+ * EMPTY it's still ours to retire, so unlike desc_reclaim_remote ()
+ * this doesn't go looking for empty descriptors.
+ */
+static void
+desc_reclaim_remote_owned (Descriptor *desc)
+{
+	static MonoBackoffSite backoff_site;
+	Anchor old_anchor, new_anchor;
+	RemoteList list;
+	MonoBackoff backoff;
+
+	if (!remote_take (desc, &list))
+		return;
+
+	mono_backoff_init (&backoff, &backoff_site);
+	do {
+		new_anchor.value = old_anchor.value = atomic64_read (&desc->anchor.value);
+		/* The remote slots are not counted, so it can't be EMPTY. */
+		g_assert (old_anchor.data.state == STATE_PARTIAL);
+		*(unsigned int*)SLOT_ADDR (desc, list.data.tail) = old_anchor.data.avail;
+		new_anchor.data.avail = list.data.head;
+		new_anchor.data.count += list.data.count;
+		g_assert (new_anchor.data.count <= desc->max_count);
+		if (new_anchor.data.count == desc->max_count)
+			new_anchor.data.state = STATE_EMPTY;
+	} while (!set_anchor (desc, old_anchor, new_anchor, &backoff));
+}
+
+/*
+ * Pushes N linked slots onto the remote list of DESC.  The list is only
+ * ever pushed onto or taken as a whole, so there is no ABA problem.
+ */
+static void
+remote_push (Descriptor *desc, unsigned int first, gpointer last, int n)
+{
+	static MonoBackoffSite backoff_site;
+	RemoteList old_list, new_list;
+	MonoBackoff backoff;
+
+	mono_backoff_init (&backoff, &backoff_site);
+	for (;;) {
+		old_list.value = atomic64_read (&desc->remote.value);
+		new_list.data.head = first;
+		if (old_list.data.count) {
+			*(unsigned int*)last = old_list.data.head;
+			new_list.data.tail = old_list.data.tail;
+		} else {
+			*(unsigned int*)last = AVAIL_NONE;
+			new_list.data.tail = SLOT_INDEX (desc, last);
+		}
+		new_list.data.count = old_list.data.count + n;
+		if (atomic64_cmpxchg (&desc->remote.value, old_list.value, new_list.value) == old_list.value)
+			break;
+		mono_backoff_once (&backoff);
+	}
+	mono_backoff_done (&backoff);
+
+	/*
+	 * If the descriptor went FULL before our push, the thread that
+	 * made it FULL might have missed our slots, so it's up to us.
+	 */
+	if (desc->anchor.data.state == STATE_FULL)
+		desc_reclaim_remote (desc);
+}
+
+/*
+ * Returns the slots PTRS [0] to PTRS [N - 1], which must all belong to
+ * DESC, with a single anchor update, or a single remote list update if
+ * the size class is in remote free mode and we're not the owner.
+ */
+static void
+free_slots (Descriptor *desc, gpointer *ptrs, int n)
+{
+	link_slots (desc, ptrs, n);
+
+	if (desc->heap->sc->remote_free && !pthread_equal (desc->owner, pthread_self ()))
+		remote_push (desc, SLOT_INDEX (desc, ptrs [0]), ptrs [n - 1], n);
+	else
+		free_chain (desc, SLOT_INDEX (desc, ptrs [0]), ptrs [n - 1], n);
+
+	if (auto_trim_pending)
+		auto_trim_step ();
+}
+
+static void
+free_slot (gpointer ptr)
+{
+	free_slots (DESCRIPTOR_FOR_ADDR (ptr), &ptr, 1);
+}
+
+static void
+sift_down (gpointer *ptrs, int root, int n)
+{
+	gpointer p = ptrs [root];
+	int child;
+
+	while ((child = 2 * root + 1) < n) {
+		if (child + 1 < n && (gulong)ptrs [child + 1] > (gulong)ptrs [child])
+			++child;
+		if ((gulong)ptrs [child] <= (gulong)p)
+			break;
+		ptrs [root] = ptrs [child];
+		root = child;
+	}
+	ptrs [root] = p;
+}
+
+/*
+ * Sorts PTRS by address, in place, because this runs in lock-free
+ * contexts, where we can't let qsort () allocate.
+ */
+static void
+sort_pointers (gpointer *ptrs, int n)
+{
+	int i;
+
+	for (i = n / 2 - 1; i >= 0; --i)
+		sift_down (ptrs, i, n);
+	for (i = n - 1; i > 0; --i) {
+		gpointer tmp = ptrs [0];
+		ptrs [0] = ptrs [i];
+		ptrs [i] = tmp;
+		sift_down (ptrs, 0, i);
+	}
+}
+
+/*
+ * Sorts PTRS, which makes slots from the same superblock adjacent, and
+ * frees each such run with a single anchor update, looking up its
+ * descriptor only once.
+ */
+static void
+free_slots_grouped (gpointer *ptrs, int n)
+{
+	int i, k;
+
+	sort_pointers (ptrs, n);
+
+	for (i = 0; i < n; i += k) {
+		Descriptor *desc = DESCRIPTOR_FOR_ADDR (ptrs [i]);
+		gulong sb_end = ((gulong)desc->sb & ~(gulong)(desc->sb_size - 1)) + desc->sb_size;
+
+		for (k = 1; i + k < n && (gulong)ptrs [i + k] < sb_end; ++k)
+			;
+
+		free_slots (desc, ptrs + i, k);
+	}
+}
+
+/*
+ * Large objects.
+ *
+ * An object that doesn't fit into a size class gets a mapping of its
+ * own, with a header that records the mapping's size.  Mapping sizes
+ * are rounded up so that there are four of them per power of two,
+ * which bounds the waste to 25% of the address space, and less of
+ * the memory actually touched.
+ *
+ * Freed mappings up to LARGE_CACHE_MAX_PAGES pages are kept in a small
+ * cache per mapping size, from which they're reused without a system
+ * call.  The cache entries are only ever CASed between NULL and a
+ * mapping and the mapping is not accessed before the CAS succeeds,
+ * so there is no ABA problem and no need for hazard pointers.  While
+ * a mapping is cached its first page stays marked in the superblock
+ * map.
+ *
+ * The cache holds at most large_cache_max_bytes.  Mappings in it age
+ * like cached superblocks and are unmapped by the same decay and by
+ * trimming.
+ */
+
+typedef struct {
+	size_t size;
+	/* The time, in milliseconds, the mapping entered the cache. */
+	size_t cache_time;
+} LargeHeader;
+
+#define LARGE_PAGE_SHIFT	SB_MAP_PAGE_SHIFT
+#define LARGE_CACHE_MAX_PAGES	8192
+/* 4 exact sizes up to 4 pages, then 4 per power of two up to 8192 pages. */
+#define LARGE_CACHE_BUCKETS	48
+#define LARGE_CACHE_SLOTS	8
+
+#define LARGE_CACHE_DEFAULT_MAX_BYTES	(64 * 1024 * 1024)
+
+static gpointer volatile large_cache [LARGE_CACHE_BUCKETS][LARGE_CACHE_SLOTS];
+static volatile gint32 large_cache_bytes;
+static volatile gint32 large_cache_max_bytes = LARGE_CACHE_DEFAULT_MAX_BYTES;
+
+/*
+ * Rounds PAGES up to a mapping size and returns its cache bucket in
+ * *BUCKET, or -1 if mappings that large are not cached.
+ */
+static size_t
+large_round_pages (size_t pages, int *bucket)
+{
+	int shift, mantissa;
+
+	if (pages <= 4) {
+		*bucket = pages - 1;
+		return pages;
+	}
+
+	shift = (sizeof (unsigned long) * 8 - 1) - __builtin_clzl (pages - 1) - 2;
+	mantissa = ((pages - 1) >> shift) + 1;
+	pages = (size_t)mantissa << shift;
+
+	*bucket = pages <= LARGE_CACHE_MAX_PAGES ? 4 + shift * 4 + (mantissa - 5) : -1;
+	g_assert (*bucket < LARGE_CACHE_BUCKETS);
+	return pages;
+}
+
+/* Returns 0 if SIZE is too large to be allocated at all. */
+static size_t
+large_mapping_size (size_t size, int *bucket)
+{
+	size_t pages;
+
+	if (size > ((size_t)1 << (sizeof (size_t) * 8 - 2)))
+		return 0;
+
+	pages = (size + sizeof (LargeHeader) + (1 << LARGE_PAGE_SHIFT) - 1) >> LARGE_PAGE_SHIFT;
+	return large_round_pages (pages, bucket) << LARGE_PAGE_SHIFT;
+}
+
+static LargeHeader*
+large_cache_get (int bucket)
+{
+	int i;
+
+	for (i = 0; i < LARGE_CACHE_SLOTS; ++i) {
+		LargeHeader *header = large_cache [bucket][i];
+		if (header && InterlockedCompareExchangePointer (&large_cache [bucket][i], NULL, header) == header) {
+			InterlockedExchangeAdd (&large_cache_bytes, -(gint32)header->size);
+			return header;
+		}
+	}
+
+	return NULL;
+}
+
+static gboolean
+large_cache_insert (int bucket, LargeHeader *header)
+{
+	int i;
+
+	for (i = 0; i < LARGE_CACHE_SLOTS; ++i) {
+		if (!large_cache [bucket][i] && InterlockedCompareExchangePointer (&large_cache [bucket][i], header, NULL) == NULL)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static gboolean
+large_cache_put (int bucket, LargeHeader *header)
+{
+	gint32 size = header->size;
+
+	if (InterlockedExchangeAdd (&large_cache_bytes, size) + size > large_cache_max_bytes)
+		goto fail;
+
+	header->cache_time = now_ms ();
+	if (large_cache_insert (bucket, header))
+		return TRUE;
+
+ fail:
+	InterlockedExchangeAdd (&large_cache_bytes, -size);
+	return FALSE;
+}
+
+static void
+large_unmap (LargeHeader *header)
+{
+	sb_map_set (header, 1 << LARGE_PAGE_SHIFT, 0);
+	mono_sgen_free_os_memory (header, header->size);
+}
+
+/*
+ * Unmaps all cached large mappings that have been in the cache for at
+ * least MIN_AGE milliseconds.
+ */
+static void
+large_cache_release (gint64 now, gint64 min_age)
+{
+	int b, i;
+
+	if (large_cache_bytes <= 0)
+		return;
+
+	for (b = 0; b < LARGE_CACHE_BUCKETS; ++b) {
+		for (i = 0; i < LARGE_CACHE_SLOTS; ++i) {
+			LargeHeader *header = large_cache [b][i];
+			if (!header || InterlockedCompareExchangePointer (&large_cache [b][i], NULL, header) != header)
+				continue;
+
+			/* It's ours now, so we can look at it. */
+			if ((size_t)now - header->cache_time < (size_t)min_age && large_cache_insert (b, header))
+				continue;
+
+			InterlockedExchangeAdd (&large_cache_bytes, -(gint32)header->size);
+			large_unmap (header);
+		}
+	}
+}
+
+/*
+ * Allocates an object of SIZE bytes outside of the size classes.
+ * Returns NULL if the memory can't be allocated.
+ */
+gpointer
+mono_lock_free_alloc_large (size_t size)
+{
+	int bucket;
+	size_t mapping_size = large_mapping_size (size, &bucket);
+	LargeHeader *header = NULL;
+
+	if (!mapping_size)
+		return NULL;
+
+	if (bucket >= 0)
+		header = large_cache_get (bucket);
+	if (!header) {
+		header = mono_sgen_alloc_os_memory (mapping_size, TRUE);
+		if (!header)
+			return NULL;
+		header->size = mapping_size;
+		sb_map_set (header, 1 << LARGE_PAGE_SHIFT, SB_MAP_LARGE);
+	}
+
+	g_assert (header->size == mapping_size);
+	return header + 1;
+}
+
+static void
+free_large (gpointer ptr)
+{
+	LargeHeader *header = (LargeHeader*)ptr - 1;
+	int bucket;
+
+	large_round_pages (header->size >> LARGE_PAGE_SHIFT, &bucket);
+	if (bucket >= 0 && large_cache_put (bucket, header))
+		return;
+
+	large_unmap (header);
+}
+
+/*
+ * Resizes a large object to SIZE bytes, which can be smaller or larger
+ * than its current size, preserving its contents.  The object is
+ * remapped rather than copied where the OS allows it.  Returns NULL,
+ * leaving the object unchanged, if the memory can't be allocated.
+ */
+gpointer
+mono_lock_free_realloc_large (gpointer ptr, size_t size)
+{
+	LargeHeader *header = (LargeHeader*)ptr - 1;
+	LargeHeader *new_header;
+	size_t old_size = header->size;
+	int bucket;
+	size_t mapping_size = large_mapping_size (size, &bucket);
+	gpointer new_ptr;
+
+	g_assert (sb_map_get (header) == SB_MAP_LARGE);
+
+	if (!mapping_size)
+		return NULL;
+	if (mapping_size == old_size)
+		return ptr;
+
+	/*
+	 * We own the object, so nobody else looks at its map entry
+	 * while we move it.
+	 */
+	sb_map_set (header, 1 << LARGE_PAGE_SHIFT, 0);
+	new_header = mono_sgen_realloc_os_memory (header, old_size, mapping_size);
+	if (new_header) {
+		new_header->size = mapping_size;
+		sb_map_set (new_header, 1 << LARGE_PAGE_SHIFT, SB_MAP_LARGE);
+		return new_header + 1;
+	}
+	sb_map_set (header, 1 << LARGE_PAGE_SHIFT, SB_MAP_LARGE);
+
+	new_ptr = mono_lock_free_alloc_large (size);
+	if (!new_ptr)
+		return NULL;
+	memcpy (new_ptr, ptr, MIN (size, old_size - sizeof (LargeHeader)));
+	free_large (ptr);
+	return new_ptr;
+}
+
+/*
+ * Per-thread magazines.
+ *
+ * If a size class has a non-zero magazine size, each thread keeps a
+ * small stack of slots of that size class which it allocates from and
+ * frees to without touching any shared data.  An empty magazine is
+ * refilled with half its capacity from the heap, a full one is
+ * flushed down to half its capacity.  The slots in a magazine are
+ * allocated as far as the heap is concerned, so they keep their
+ * superblocks alive until they are flushed, which happens at the
+ * latest when the thread exits.
+ *
+ * The magazines live in a per-thread block of state, together with
+ * the thread's descriptor cache and its counters if statistics are
+ * compiled in.  A thread only gets a magazine for a size class once
+ * it uses it, carved from a small arena of its block.  The blocks are
+ * kept in a global list and never freed.  When a thread exits its
+ * magazines are flushed and its block is marked as unused, to be taken
+ * over by the next thread that needs one.  The counters stay, so
+ * summing over all blocks gives totals that include exited threads,
+ * while the hot paths never write to shared memory to update them.
+ */
+
+typedef struct {
+	unsigned int count;
+	gpointer slots [MONO_LOCK_FREE_ALLOC_MAGAZINE_MAX_SIZE];
+} Magazine;
+
+#define MAGAZINE_ARENA_SIZE	4096
+
+#ifdef MONO_LOCK_FREE_ALLOC_STATS
+typedef union {
+	MonoLockFreeAllocStats stats;
+	char pad [(sizeof (MonoLockFreeAllocStats) + MONO_LOCK_FREE_ALLOC_CACHE_LINE_SIZE - 1) & ~(MONO_LOCK_FREE_ALLOC_CACHE_LINE_SIZE - 1)];
+} PaddedStats;
+#endif
+
+typedef struct _ThreadState ThreadState;
+struct _ThreadState {
+	/* NULL until first used, then kept when the block is reused. */
+	Magazine *magazines [MONO_LOCK_FREE_ALLOC_MAX_SIZE_CLASSES];
+	/* The rest of the arena the next magazine is carved from. */
+	char *magazine_arena;
+	size_t magazine_arena_left;
+#ifndef DESC_AVAIL_DUMMY
+	DescCache desc_cache;
+#endif
+#ifdef MONO_LOCK_FREE_ALLOC_STATS
+	PaddedStats stats [MONO_LOCK_FREE_ALLOC_MAX_SIZE_CLASSES];
+#endif
+	ThreadState *next;
+	volatile gint32 in_use;
+};
+
+static ThreadState * volatile thread_states;
+
+static volatile gint32 num_size_classes;
+
+static pthread_once_t thread_state_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_state_key;
+
+static void
+magazine_flush (Magazine *mag, unsigned int keep)
+{
+	if (mag->count <= keep)
+		return;
+	free_slots_grouped (mag->slots + keep, mag->count - keep);
+	mag->count = keep;
+}
+
+static void
+thread_state_free (gpointer _ts)
+{
+	ThreadState *ts = _ts;
+	int i;
+
+	/* Flushing updates the counters, which must not make a new block. */
+	pthread_setspecific (thread_state_key, ts);
+
+	for (i = 0; i < MONO_LOCK_FREE_ALLOC_MAX_SIZE_CLASSES; ++i) {
+		if (ts->magazines [i])
+			magazine_flush (ts->magazines [i], 0);
+	}
+#ifndef DESC_AVAIL_DUMMY
+	desc_cache_drain (&ts->desc_cache, 0);
+#endif
+
+	pthread_setspecific (thread_state_key, NULL);
+
+	mono_memory_write_barrier ();
+	ts->in_use = FALSE;
+}
+
+static void
+thread_state_key_init (void)
+{
+	pthread_key_create (&thread_state_key, thread_state_free);
+}
+
+static ThreadState*
+thread_state_get (void)
+{
+	ThreadState *ts;
+
+	pthread_once (&thread_state_key_once, thread_state_key_init);
+
+	ts = pthread_getspecific (thread_state_key);
+	if (ts)
+		return ts;
+
+	/* Magazines of unused blocks are empty. */
+	for (ts = thread_states; ts; ts = ts->next) {
+		if (!ts->in_use && InterlockedCompareExchange (&ts->in_use, TRUE, FALSE) == FALSE)
+			break;
+	}
+
+	if (!ts) {
+		ThreadState *head;
+
+		/* Fresh memory is zeroed, so there are no magazines yet. */
+		ts = mono_sgen_alloc_os_memory (sizeof (ThreadState), TRUE);
+		g_assert (ts);
+		ts->in_use = TRUE;
+		do {
+			head = thread_states;
+			ts->next = head;
+			mono_memory_write_barrier ();
+		} while (InterlockedCompareExchangePointer ((gpointer * volatile)&thread_states, ts, head) != head);
+	}
+
+	pthread_setspecific (thread_state_key, ts);
+	return ts;
+}
+
+static Magazine*
+thread_magazine (MonoLockFreeAllocSizeClass *sc)
+{
+	ThreadState *ts = thread_state_get ();
+	Magazine *mag = ts->magazines [sc->index];
+
+	if (mag)
+		return mag;
+
+	/* Fresh memory is zeroed, so the magazine is empty. */
+	if (ts->magazine_arena_left < sizeof (Magazine)) {
+		ts->magazine_arena = mono_sgen_alloc_os_memory (MAGAZINE_ARENA_SIZE, TRUE);
+		g_assert (ts->magazine_arena);
+		ts->magazine_arena_left = MAGAZINE_ARENA_SIZE;
+	}
+	mag = (Magazine*)ts->magazine_arena;
+	ts->magazine_arena += sizeof (Magazine);
+	ts->magazine_arena_left -= sizeof (Magazine);
+
+	ts->magazines [sc->index] = mag;
+	return mag;
+}
+
+#ifndef DESC_AVAIL_DUMMY
+/* Returns NULL if CREATE is FALSE and the thread has no state block. */
+static DescCache*
+thread_desc_cache (gboolean create)
+{
+	ThreadState *ts;
+
+	if (create)
+		return &thread_state_get ()->desc_cache;
+
+	pthread_once (&thread_state_key_once, thread_state_key_init);
+	ts = pthread_getspecific (thread_state_key);
+	return ts ? &ts->desc_cache : NULL;
+}
+#endif
+
+#ifdef MONO_LOCK_FREE_ALLOC_STATS
+static MonoLockFreeAllocStats*
+thread_stats (MonoLockFreeAllocSizeClass *sc)
+{
+	return &thread_state_get ()->stats [sc->index].stats;
+}
+
+/*
+ * Sums the counters of all threads for SC.  The counters of running
+ * threads are read without synchronization, so the result is only a
+ * snapshot.
+ */
+void
+mono_lock_free_allocator_get_stats (MonoLockFreeAllocSizeClass *sc, MonoLockFreeAllocStats *stats)
+{
+	ThreadState *ts;
+
+	memset (stats, 0, sizeof (MonoLockFreeAllocStats));
+
+	for (ts = thread_states; ts; ts = ts->next) {
+		MonoLockFreeAllocStats *s = &ts->stats [sc->index].stats;
+		stats->allocs += s->allocs;
+		stats->frees += s->frees;
+		stats->sb_allocs += s->sb_allocs;
+		stats->sb_retires += s->sb_retires;
+		stats->partial_gets += s->partial_gets;
+		stats->partial_puts += s->partial_puts;
+		stats->active_cas_failures += s->active_cas_failures;
+		stats->anchor_cas_retries += s->anchor_cas_retries;
+	}
+}
+#endif
+
+gpointer
+mono_lock_free_alloc (MonoLockFreeAllocator *heap)
+{
+	MonoLockFreeAllocSizeClass *sc = heap->sc;
+	unsigned int magazine_size = sc->magazine_size;
+	Magazine *mag;
+
+	STAT_INC (sc, allocs);
+
+	if (!magazine_size)
+		return alloc_slot (heap);
+
+	mag = thread_magazine (sc);
+	if (!mag->count) {
+		mag->count = magazine_size > 1 ? magazine_size / 2 : 1;
+		alloc_slots (heap, mag->slots, mag->count);
+	}
+
+	return mag->slots [--mag->count];
+}
+
+void
+mono_lock_free_free (gpointer ptr)
+{
+	guint8 bits = sb_map_get (ptr);
+	MonoLockFreeAllocSizeClass *sc;
+	unsigned int magazine_size;
+	Magazine *mag;
+
+	if (bits == SB_MAP_LARGE) {
+		free_large (ptr);
+		return;
+	}
+
+	sc = (*(Descriptor**)sb_header_for_bits (ptr, bits))->heap->sc;
+	magazine_size = sc->magazine_size;
+
+	STAT_INC (sc, frees);
+
+	if (!magazine_size) {
+		free_slot (ptr);
+		return;
+	}
+
+	mag = thread_magazine (sc);
+	if (mag->count >= magazine_size)
+		magazine_flush (mag, magazine_size / 2);
+
+	mag->slots [mag->count++] = ptr;
+}
+
+/*
+ * Allocates a slot aligned to ALIGNMENT, which must be a power of two
+ * no larger than the alignment of the heap's size class.
+ */
+gpointer
+mono_lock_free_alloc_aligned (MonoLockFreeAllocator *heap, unsigned int alignment)
+{
+	g_assert (!(alignment & (alignment - 1)));
+	g_assert (alignment <= heap->sc->alignment);
+	return mono_lock_free_alloc (heap);
+}
+
+/*
+ * Returns the number of bytes available at PTR, which is the slot size
+ * for slots and at least the requested size for large objects.
+ */
+size_t
+mono_lock_free_usable_size (gpointer ptr)
+{
+	guint8 bits = sb_map_get (ptr);
+
+	if (bits == SB_MAP_LARGE)
+		return ((LargeHeader*)ptr - 1)->size - sizeof (LargeHeader);
+
+	return (*(Descriptor**)sb_header_for_bits (ptr, bits))->slot_size;
+}
+
+/*
+ * Allocates N slots, taking as many as possible from each descriptor
+ * with a single anchor update.  This bypasses the magazines.
+ */
+void
+mono_lock_free_alloc_batch (MonoLockFreeAllocator *heap, gpointer *ptrs, int n)
+{
+	STAT_ADD (heap->sc, allocs, n);
+	alloc_slots (heap, ptrs, n);
+}
+
+/*
+ * Frees N slots, which may come from different heaps and size
+ * classes, with one anchor update per superblock.  This bypasses the
+ * magazines.  The order of PTRS is changed.
+ */
+void
+mono_lock_free_free_batch (gpointer *ptrs, int n)
+{
+#ifdef MONO_LOCK_FREE_ALLOC_STATS
+	int i;
+
+	for (i = 0; i < n; ++i)
+		STAT_INC (DESCRIPTOR_FOR_ADDR (ptrs [i])->heap->sc, frees);
+#endif
+
+	free_slots_grouped (ptrs, n);
+}
+
+/*
+ * Returns all slots in the current thread's magazines to their heaps,
+ * and its cached descriptors to the global stack.  This happens
+ * automatically when the thread exits.
+ */
+void
+mono_lock_free_allocator_flush_thread_cache (void)
+{
+	ThreadState *ts;
+	int i;
+
+	pthread_once (&thread_state_key_once, thread_state_key_init);
+
+	ts = pthread_getspecific (thread_state_key);
+	if (!ts)
+		return;
+
+	for (i = 0; i < MONO_LOCK_FREE_ALLOC_MAX_SIZE_CLASSES; ++i) {
+		if (ts->magazines [i])
+			magazine_flush (ts->magazines [i], 0);
+	}
+#ifndef DESC_AVAIL_DUMMY
+	desc_cache_drain (&ts->desc_cache, 0);
+#endif
+}
+
+/*
+ * Trimming.
+ *
+ * We go through the partial queues of a size class one descriptor at a
+ * time: we dequeue it, which makes us its owner, trim it and requeue it
+ * right away, so that allocating threads still find all the other
+ * partial descriptors while we trim.  A pass only looks at as many
+ * descriptors of a queue as the queue held when the pass got to it,
+ * so descriptors that we or others requeue behind them don't keep us
+ * going, and a descriptor already trimmed in this pass is just put
+ * back.  A pass can be done in steps, which is how the automatic
+ * trimming spreads it over many frees.
+ *
+ * To relink the free slots of a descriptor we first take its free
+ * list, so that slots freed in the meantime go onto a new list that
+ * doesn't link into ours.  Then we lower the bump index over free
+ * slots at the top, trim every chunk that lies entirely within a run
+ * of free slots, give the pages of those chunks and of everything
+ * above the bump index back to the OS, and link the remaining free
+ * slots in front of the new list.
+ *
+ * Active descriptors are not trimmed.
+ */
+
+#define TRIM_PAGE_SIZE		(1UL << SB_MAP_PAGE_SHIFT)
+#define TRIM_CHUNKS		64
+#define TRIM_CHUNK_SIZE(d)	MAX (TRIM_PAGE_SIZE, (d)->sb_size / TRIM_CHUNKS)
+#define SB_START(d)		((gulong)(d)->sb & ~(gulong)((d)->sb_size - 1))
+#define SLOT_CHUNK(d,i)		(((gulong)SLOT_ADDR ((d), (i)) - SB_START ((d))) / TRIM_CHUNK_SIZE ((d)))
+
+#define BITMAP_WORD_BITS	(sizeof (gulong) * 8)
+#define BITMAP_SIZE(n)		(((n) + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS * sizeof (gulong))
+#define BITMAP_TEST(b,i)	((b) [(i) / BITMAP_WORD_BITS] & (1UL << ((i) % BITMAP_WORD_BITS)))
+#define BITMAP_SET(b,i)		((b) [(i) / BITMAP_WORD_BITS] |= (1UL << ((i) % BITMAP_WORD_BITS)))
+
+static MonoLockFreeAllocSizeClass *size_classes [MONO_LOCK_FREE_ALLOC_MAX_SIZE_CLASSES];
+static MonoBackoffSite trim_backoff_site;
+
+/* The next size class the automatic trimming looks at. */
+static int auto_trim_next;
+/* Nonzero while a thread does a step of automatic trimming. */
+static volatile gint32 auto_trimming;
+
+static void
+discard_range (gpointer start, gpointer end)
+{
+	gulong s = ((gulong)start + TRIM_PAGE_SIZE - 1) & ~(TRIM_PAGE_SIZE - 1);
+	gulong e = (gulong)end & ~(TRIM_PAGE_SIZE - 1);
 
- retry:
-	desc = heap->active;
-	if (desc) {
-		if (InterlockedCompareExchangePointer ((gpointer * volatile)&heap->active, NULL, desc) != desc)
-			goto retry;
-	} else {
-		desc = heap_get_partial (heap);
-		if (!desc)
-			return NULL;
-	}
+	if (s < e)
+		mono_vdiscard ((gpointer)s, e - s);
+}
 
-	/* Now we own the desc. */
+/* The index of the first slot of DESC that starts at or after ADDR. */
+static unsigned int
+slot_index_at_or_after (Descriptor *desc, gulong addr)
+{
+	gulong sb = (gulong)desc->sb;
+	gulong index;
+
+	if (addr <= sb)
+		return 0;
+	index = (addr - sb + desc->slot_size - 1) / desc->slot_size;
+	return MIN (index, desc->max_count);
+}
 
+/*
+ * Makes the slots of the lowest trimmed chunk of DESC, which we own,
+ * ordinary free slots, if only trimmed slots are left.
+ */
+static void
+desc_untrim (Descriptor *desc)
+{
+	Anchor old_anchor, new_anchor;
+	gulong chunk_size = TRIM_CHUNK_SIZE (desc);
+	unsigned int i, lo, hi;
+	MonoBackoff backoff;
+
+	old_anchor.value = atomic64_read (&desc->anchor.value);
+	if (old_anchor.data.state != STATE_PARTIAL || ANCHOR_NUM_LISTED (old_anchor, desc) || old_anchor.data.bump < desc->max_count)
+		return;
+
+	/* Chunks in the middle of large slots have no slots starting in them. */
 	do {
-		unsigned int next;
+		int chunk;
 
-		new_anchor = old_anchor = *(volatile Anchor*)&desc->anchor.value;
-		if (old_anchor.data.state == STATE_EMPTY) {
-			/* We must free it because we own it. */
-			desc_retire (desc);
-			goto retry;
-		}
-		g_assert (old_anchor.data.state == STATE_PARTIAL);
-		g_assert (old_anchor.data.count > 0);
+		g_assert (desc->trimmed);
+		chunk = __builtin_ctzll (desc->trimmed);
+		desc->trimmed &= ~(1ULL << chunk);
+		lo = slot_index_at_or_after (desc, SB_START (desc) + chunk * chunk_size);
+		hi = slot_index_at_or_after (desc, SB_START (desc) + (chunk + 1) * chunk_size);
+	} while (lo == hi);
 
-		addr = (char*)desc->sb + old_anchor.data.avail * desc->slot_size;
+	for (i = lo; i < hi - 1; ++i)
+		*(unsigned int*)SLOT_ADDR (desc, i) = i + 1;
+	g_assert (desc->num_trimmed >= hi - lo);
+	desc->num_trimmed -= hi - lo;
 
-		mono_memory_read_barrier ();
+	mono_backoff_init (&backoff, &trim_backoff_site);
+	do {
+		new_anchor.value = old_anchor.value = atomic64_read (&desc->anchor.value);
+		*(unsigned int*)SLOT_ADDR (desc, hi - 1) = old_anchor.data.avail;
+		new_anchor.data.avail = lo;
+	} while (!set_anchor (desc, old_anchor, new_anchor, &backoff));
+}
 
-		next = *(unsigned int*)addr;
-		g_assert (next < SB_USABLE_SIZE / desc->slot_size);
+/*
+ * Trims DESC, which we own.  Returns FALSE if it turned out to be
+ * empty, in which case it's retired and we no longer own it.
+ */
+static gboolean
+desc_trim (Descriptor *desc, gulong *bitmap)
+{
+	Anchor old_anchor, new_anchor;
+	unsigned int max_count = desc->max_count;
+	unsigned int i, index, bump, lo, hi, num_listed, num_free, num_trimmed;
+	unsigned int first = AVAIL_NONE;
+	gulong chunk_size = TRIM_CHUNK_SIZE (desc);
+	gulong sb_start = SB_START (desc);
+	guint64 trimmed;
+	gpointer tail = NULL;
+	MonoBackoff backoff;
+	int chunk;
+
+	if (desc->remote.data.count)
+		desc_reclaim_remote_owned (desc);
+
+	mono_backoff_init (&backoff, &trim_backoff_site);
+	do {
+		new_anchor.value = old_anchor.value = atomic64_read (&desc->anchor.value);
+		if (old_anchor.data.state == STATE_EMPTY)
+			goto done;
+		new_anchor.data.avail = AVAIL_NONE;
+	} while (!set_anchor (desc, old_anchor, new_anchor, &backoff));
+
+	g_assert (old_anchor.data.state == STATE_PARTIAL);
+
+	mono_memory_read_barrier ();
+
+	num_listed = ANCHOR_NUM_LISTED (old_anchor, desc);
+	index = old_anchor.data.avail;
+	for (i = 0; i < num_listed; ++i) {
+		g_assert (index < old_anchor.data.bump);
+		BITMAP_SET (bitmap, index);
+		index = *(unsigned int*)SLOT_ADDR (desc, index);
+	}
+	g_assert (index == AVAIL_NONE);
+	for (i = 0; i < old_anchor.data.bump; ++i) {
+		if (desc->trimmed & (1ULL << SLOT_CHUNK (desc, i)))
+			BITMAP_SET (bitmap, i);
+	}
+	num_free = num_listed + desc->num_trimmed + (max_count - old_anchor.data.bump);
 
-		new_anchor.data.avail = next;
-		--new_anchor.data.count;
+	bump = old_anchor.data.bump;
+	while (bump > 0 && BITMAP_TEST (bitmap, bump - 1))
+		--bump;
 
-		if (new_anchor.data.count == 0)
-			new_anchor.data.state = STATE_FULL;
-	} while (!set_anchor (desc, old_anchor, new_anchor));
+	/*
+	 * We start over with the chunks: a chunk trimmed before might
+	 * have been written to by a slot reaching into it since then.
+	 */
+	trimmed = 0;
+	for (lo = 0; lo < bump; lo = hi + 1) {
+		gulong start, end;
+		while (lo < bump && !BITMAP_TEST (bitmap, lo))
+			++lo;
+		for (hi = lo; hi < bump && BITMAP_TEST (bitmap, hi); ++hi)
+			;
+		if (lo == hi)
+			break;
+		start = ((gulong)SLOT_ADDR (desc, lo) - sb_start + chunk_size - 1) / chunk_size;
+		end = ((gulong)SLOT_ADDR (desc, hi) - sb_start) / chunk_size;
+		for (; start < end; ++start)
+			trimmed |= 1ULL << start;
+	}
 
-	/* If the desc is partial we have to give it back. */
-	if (new_anchor.data.state == STATE_PARTIAL) {
-		if (InterlockedCompareExchangePointer ((gpointer * volatile)&heap->active, desc, NULL) != NULL)
-			heap_put_partial (desc);
+	num_trimmed = 0;
+	for (i = 0; i < bump; ++i) {
+		if (!BITMAP_TEST (bitmap, i))
+			continue;
+		--num_free;
+		if (trimmed & (1ULL << SLOT_CHUNK (desc, i))) {
+			++num_trimmed;
+			continue;
+		}
+		if (tail)
+			*(unsigned int*)tail = i;
+		else
+			first = i;
+		tail = SLOT_ADDR (desc, i);
+	}
+	g_assert (num_free == max_count - bump);
+
+	for (chunk = 0; chunk < TRIM_CHUNKS; chunk = hi) {
+		while (chunk < TRIM_CHUNKS && !(trimmed & (1ULL << chunk)))
+			++chunk;
+		for (hi = chunk; hi < TRIM_CHUNKS && (trimmed & (1ULL << hi)); ++hi)
+			;
+		if (hi > chunk)
+			mono_vdiscard ((gpointer)(sb_start + chunk * chunk_size), (hi - chunk) * chunk_size);
 	}
+	discard_range (SLOT_ADDR (desc, bump), (gpointer)(sb_start + desc->sb_size));
 
-	return addr;
+	desc->trimmed = trimmed;
+	desc->num_trimmed = num_trimmed;
+
+	mono_backoff_init (&backoff, &trim_backoff_site);
+	do {
+		new_anchor.value = old_anchor.value = atomic64_read (&desc->anchor.value);
+		if (old_anchor.data.state == STATE_EMPTY)
+			break;
+		if (tail) {
+			*(unsigned int*)tail = old_anchor.data.avail;
+			new_anchor.data.avail = first;
+		}
+		new_anchor.data.bump = bump;
+	} while (!set_anchor (desc, old_anchor, new_anchor, &backoff));
+
+ done:
+	if (desc->anchor.data.state == STATE_EMPTY) {
+		desc_retire (desc);
+		return FALSE;
+	}
+	return TRUE;
 }
 
-static gpointer
-alloc_from_new_sb (MonoLockFreeAllocator *heap)
+/*
+ * Trims up to BUDGET descriptors of the current pass over SC, starting
+ * a new pass if there is none.  Returns TRUE if the pass is done.  We
+ * must be the thread that is trimming SC.
+ */
+static gboolean
+trim_descs (MonoLockFreeAllocSizeClass *sc, int budget)
 {
-	unsigned int slot_size, count, i;
-	Descriptor *desc = desc_alloc ();
+	unsigned int num_stripes = sc->num_partial_stripes;
+	unsigned int num_queues = sc->num_partial_bins * num_stripes;
+	size_t bitmap_size = BITMAP_SIZE ((sc->sb_size - sc->slot_offset) / sc->slot_size);
+	Descriptor *desc;
 
-	desc->sb = alloc_sb (desc);
+	/* The bitmap is only ever used by the trimming thread. */
+	if (!sc->trim_bitmap)
+		sc->trim_bitmap = mono_sgen_alloc_os_memory (bitmap_size, TRUE);
 
-	slot_size = desc->slot_size = heap->sc->slot_size;
-	count = SB_USABLE_SIZE / slot_size;
+	if (sc->trim_queue < 0) {
+		InterlockedIncrement (&sc->trim_pass);
+		sc->trim_queue = 0;
+		sc->trim_left = PARTIAL_COUNT (sc, 0, 0);
+	}
 
-	/* Organize blocks into linked list. */
-	for (i = 1; i < count - 1; ++i)
-		*(unsigned int*)((char*)desc->sb + i * slot_size) = i + 1;
+	while (budget > 0) {
+		unsigned int bin = sc->trim_queue / num_stripes;
+		unsigned int stripe = sc->trim_queue % num_stripes;
 
-	desc->heap = heap;
-	/*
-	 * Setting avail to 1 because 0 is the block we're allocating
-	 * right away.
-	 */
-	desc->anchor.data.avail = 1;
-	desc->slot_size = heap->sc->slot_size;
-	desc->max_count = count;
+		if (sc->trim_left <= 0 || !(desc = partial_dequeue (sc, bin, stripe))) {
+			if (++sc->trim_queue >= num_queues) {
+				sc->trim_queue = -1;
+				return TRUE;
+			}
+			sc->trim_left = PARTIAL_COUNT (sc, sc->trim_queue / num_stripes, sc->trim_queue % num_stripes);
+			continue;
+		}
+		--sc->trim_left;
+		--budget;
 
-	desc->anchor.data.count = desc->max_count - 1;
-	desc->anchor.data.state = STATE_PARTIAL;
+		if (desc->remote.data.count)
+			desc_reclaim_remote_owned (desc);
+		if (desc->anchor.data.state == STATE_EMPTY) {
+			desc_retire (desc);
+			continue;
+		}
+		if (desc->trim_pass != sc->trim_pass) {
+			desc->trim_pass = sc->trim_pass;
+			memset (sc->trim_bitmap, 0, bitmap_size);
+			if (!desc_trim (desc, sc->trim_bitmap))
+				continue;
+		}
+		list_put_partial (desc);
+	}
+
+	return FALSE;
+}
+
+/*
+ * Does a whole pass over SC.  Does nothing if another thread is
+ * trimming SC already.
+ */
+static void
+trim_size_class (MonoLockFreeAllocSizeClass *sc)
+{
+	if (InterlockedCompareExchange (&sc->trimming, 1, 0) != 0)
+		return;
+
+	/* A pass the automatic trimming is in the middle of starts over. */
+	sc->trim_queue = -1;
+	trim_descs (sc, INT_MAX);
 
 	mono_memory_write_barrier ();
+	sc->trimming = 0;
+}
 
-	/* Make it active or free it again. */
-	if (InterlockedCompareExchangePointer ((gpointer * volatile)&heap->active, desc, NULL) == NULL) {
-		return desc->sb;
-	} else {
-		desc->anchor.data.state = STATE_EMPTY;
-		desc_retire (desc);
-		return NULL;
+static void
+auto_trim (void)
+{
+	int i;
+
+	for (i = 0; i < num_size_classes; ++i) {
+		MonoLockFreeAllocSizeClass *sc = size_classes [i];
+		if (sc && sc->auto_trim)
+			trim_size_class (sc);
 	}
 }
 
-gpointer
-mono_lock_free_alloc (MonoLockFreeAllocator *heap)
+/*
+ * Trims one descriptor of the size classes in auto trim mode, and
+ * clears AUTO_TRIM_PENDING once all of them have been done.  Does
+ * nothing if another thread is doing a step.
+ */
+static void
+auto_trim_step (void)
 {
-	gpointer addr;
+	MonoLockFreeAllocSizeClass *sc = NULL;
 
-	for (;;) {
+	if (InterlockedCompareExchange (&auto_trimming, 1, 0) != 0)
+		return;
 
-		addr = alloc_from_active_or_partial (heap);
-		if (addr)
+	while (auto_trim_next < num_size_classes) {
+		sc = size_classes [auto_trim_next];
+		if (sc && sc->auto_trim)
 			break;
+		++auto_trim_next;
+	}
 
-		addr = alloc_from_new_sb (heap);
-		if (addr)
-			break;
+	if (auto_trim_next >= num_size_classes) {
+		auto_trim_next = 0;
+		auto_trim_pending = 0;
+	} else if (InterlockedCompareExchange (&sc->trimming, 1, 0) == 0) {
+		if (trim_descs (sc, 1))
+			++auto_trim_next;
+		mono_memory_write_barrier ();
+		sc->trimming = 0;
 	}
 
-	return addr;
+	mono_memory_write_barrier ();
+	auto_trimming = 0;
 }
 
+/*
+ * Gives the memory of free slots in the partial superblocks of SC, as
+ * far as they span whole pages, and of all cached superblocks and large
+ * mappings back to the OS.  The pages are faulted in again when the
+ * slots are used.  If another thread is trimming SC at the same time,
+ * only the caches are released.
+ */
 void
-mono_lock_free_free (gpointer ptr)
+mono_lock_free_allocator_trim (MonoLockFreeAllocSizeClass *sc)
 {
-	Anchor old_anchor, new_anchor;
-	Descriptor *desc;
-	gpointer sb;
-	MonoLockFreeAllocator *heap = NULL;
+	trim_size_class (sc);
+	sb_cache_release (now_ms (), 0);
+	large_cache_release (now_ms (), 0);
+}
 
-	desc = DESCRIPTOR_FOR_ADDR (ptr);
-	sb = desc->sb;
-	g_assert (SB_HEADER_FOR_ADDR (ptr) == SB_HEADER_FOR_ADDR (sb));
+/*
+ * In auto trim mode SC is trimmed after every decay of the superblock
+ * cache, a descriptor per free.  Cached superblocks are still only
+ * released once they have aged.
+ */
+void
+mono_lock_free_allocator_set_auto_trim (MonoLockFreeAllocSizeClass *sc, gboolean auto_trim)
+{
+	sc->auto_trim = auto_trim;
+}
 
-	do {
-		new_anchor = old_anchor = *(volatile Anchor*)&desc->anchor.value;
-		*(unsigned int*)ptr = old_anchor.data.avail;
-		new_anchor.data.avail = ((char*)ptr - (char*)sb) / desc->slot_size;
-		g_assert (new_anchor.data.avail < SB_USABLE_SIZE / desc->slot_size);
+/*
+ * Heap walk.
+ *
+ * We walk over all descriptors ever allocated and report those that
+ * are in use by the size class in question.  Nothing is locked and
+ * nothing is written, so allocation and freeing go on unimpeded.
+ * Everything we report comes from the descriptor, the anchor in
+ * particular, which we read atomically: we never look at the slots,
+ * which might be unmapped under our feet.
+ *
+ * A descriptor can be retired and reused while we look at it.  Its
+ * generation is incremented once it is retired and once it has been
+ * set up again, so it's odd in between.  If the generation is odd or
+ * changes while we read the descriptor we skip it, since it either
+ * wasn't in use or has been reused, in which case its report would
+ * mix two superblocks.
+ */
 
-		if (old_anchor.data.state == STATE_FULL)
-			new_anchor.data.state = STATE_PARTIAL;
+static gboolean
+descriptor_get_info (Descriptor *desc, MonoLockFreeAllocSizeClass *sc, MonoLockFreeAllocSbInfo *info)
+{
+	gint32 generation = desc->generation;
+	MonoLockFreeAllocator *heap;
+	Anchor anchor;
+	RemoteList remote;
+
+	if (generation & 1)
+		return FALSE;
+	mono_memory_read_barrier ();
+
+	heap = desc->heap;
+	if (!heap || heap->sc != sc)
+		return FALSE;
+
+	info->heap = heap;
+	info->sb = desc->sb;
+	info->sb_size = desc->sb_size;
+	info->slot_size = desc->slot_size;
+	info->num_slots = desc->max_count;
+	info->num_trimmed = desc->num_trimmed;
+	anchor.value = atomic64_read (&desc->anchor.value);
+	remote.value = atomic64_read (&desc->remote.value);
+
+	mono_memory_read_barrier ();
+	if (desc->generation != generation)
+		return FALSE;
+
+	info->state = anchor.data.state;
+	info->num_free = anchor.data.count;
+	info->num_untouched = info->num_slots - anchor.data.bump;
+	/* The owner changes the trimmed slots without touching the anchor. */
+	if (info->num_trimmed > anchor.data.count - info->num_untouched)
+		info->num_trimmed = anchor.data.count - info->num_untouched;
+	info->num_listed = anchor.data.count - info->num_untouched - info->num_trimmed;
+	info->num_remote = remote.data.count;
+	return TRUE;
+}
 
-		if (++new_anchor.data.count == desc->max_count) {
-			heap = desc->heap;
-			new_anchor.data.state = STATE_EMPTY;
+/*
+ * Calls FUNC for every superblock of SC that is in use while the walk
+ * runs, with a snapshot of its state, in partition PARTITION of
+ * NUM_PARTITIONS.  The partitions are disjoint and together cover all
+ * superblocks, so several threads can walk a heap in parallel.
+ * Superblocks allocated or retired during the walk may or may not be
+ * reported.
+ */
+void
+mono_lock_free_allocator_walk_partition (MonoLockFreeAllocSizeClass *sc, int partition, int num_partitions,
+		MonoLockFreeAllocWalkFunc func, gpointer user_data)
+{
+	DescBatch *batch;
+	int b, i;
+
+	g_assert (partition >= 0 && partition < num_partitions);
+
+	for (batch = desc_batches, b = 0; batch; batch = batch->next, ++b) {
+		if (b % num_partitions != partition)
+			continue;
+		for (i = 0; i < NUM_DESC_BATCH; ++i) {
+			MonoLockFreeAllocSbInfo info;
+			if (descriptor_get_info (&batch->descs [i], sc, &info))
+				func (&info, user_data);
 		}
-	} while (!set_anchor (desc, old_anchor, new_anchor));
-
-	if (new_anchor.data.state == STATE_EMPTY) {
-		g_assert (old_anchor.data.state != STATE_EMPTY);
+	}
+}
 
-		if (InterlockedCompareExchangePointer ((gpointer * volatile)&heap->active, NULL, desc) == desc) {
-			/* We own it, so we free it. */
-			desc_retire (desc);
-		} else {
-			/*
-			 * Somebody else must free it, so we do some
-			 * freeing for others.
-			 */
-			list_remove_empty_desc (heap->sc);
-		}
-	} else if (old_anchor.data.state == STATE_FULL) {
-		/*
-		 * Nobody owned it, now we do, so we need to give it
-		 * back.
-		 */
+void
+mono_lock_free_allocator_walk (MonoLockFreeAllocSizeClass *sc, MonoLockFreeAllocWalkFunc func, gpointer user_data)
+{
+	mono_lock_free_allocator_walk_partition (sc, 0, 1, func, user_data);
+}
 
-		g_assert (new_anchor.data.state == STATE_PARTIAL);
+static void
+occupancy_add (MonoLockFreeAllocSbInfo *info, gpointer user_data)
+{
+	MonoLockFreeAllocOccupancy *occupancy = user_data;
+
+	++occupancy->num_sbs [info->state];
+	occupancy->sb_bytes += info->sb_size;
+	occupancy->num_slots += info->num_slots;
+	occupancy->num_free += info->num_free + info->num_remote;
+	occupancy->num_untouched += info->num_untouched;
+	occupancy->num_trimmed += info->num_trimmed;
+}
 
-		if (InterlockedCompareExchangePointer ((gpointer * volatile)&desc->heap->active, desc, NULL) != NULL)
-			heap_put_partial (desc);
-	}
+/*
+ * Sums up the superblocks of SC.  Free slots include slots on remote
+ * lists.
+ */
+void
+mono_lock_free_allocator_get_occupancy (MonoLockFreeAllocSizeClass *sc, MonoLockFreeAllocOccupancy *occupancy)
+{
+	memset (occupancy, 0, sizeof (MonoLockFreeAllocOccupancy));
+	mono_lock_free_allocator_walk (sc, occupancy_add, occupancy);
 }
 
 #define g_assert_OR_PRINT(c, format, ...)	do {				\
@@ -503,13 +2528,12 @@ static void
 descriptor_check_consistency (Descriptor *desc, gboolean print)
 {
 	int count = desc->anchor.data.count;
-	int max_count = SB_USABLE_SIZE / desc->slot_size;
-#if _MSC_VER
-	gboolean* linked = alloca(max_count*sizeof(gboolean));
-#else
-	gboolean linked [max_count];
-#endif
-	int i, last;
+	int max_count = (desc->sb_size - desc->heap->sc->slot_offset) / desc->slot_size;
+	/* Large superblocks have too many slots for the stack. */
+	gboolean *linked = g_malloc0 (max_count * sizeof (gboolean));
+	int bump = desc->anchor.data.bump;
+	int num_listed = ANCHOR_NUM_LISTED (desc->anchor, desc);
+	int i, last, num_trimmed;
 	unsigned int index;
 
 #ifndef DESC_AVAIL_DUMMY
@@ -520,6 +2544,9 @@ descriptor_check_consistency (Descriptor *desc, gboolean print)
 #endif
 
 	g_assert_OR_PRINT (desc->slot_size == desc->heap->sc->slot_size, "slot size doesn't match size class\n");
+	g_assert_OR_PRINT (desc->sb_size == desc->heap->sc->sb_size, "superblock size doesn't match size class\n");
+	g_assert_OR_PRINT (desc->max_count == max_count, "slot count is %d but should be %d\n", desc->max_count, max_count);
+	g_assert_OR_PRINT (!((gulong)desc->sb & (desc->heap->sc->alignment - 1)), "slots are not aligned to %d bytes\n", desc->heap->sc->alignment);
 
 	if (print)
 		g_print ("descriptor %p is ", desc);
@@ -544,16 +2571,24 @@ descriptor_check_consistency (Descriptor *desc, gboolean print)
 		g_assert_OR_PRINT (FALSE, "invalid state\n");
 	}
 
-	for (i = 0; i < max_count; ++i)
-		linked [i] = FALSE;
+	g_assert_OR_PRINT (bump <= max_count, "bump index %d beyond the last slot %d\n", bump, max_count);
+	g_assert_OR_PRINT (num_listed >= 0, "count %d is below the %d never used and trimmed slots\n", count, max_count - bump + desc->num_trimmed);
+	num_trimmed = 0;
+	for (i = 0; i < bump; ++i) {
+		if (desc->trimmed & (1ULL << SLOT_CHUNK (desc, i))) {
+			linked [i] = TRUE;
+			++num_trimmed;
+		}
+	}
+	g_assert_OR_PRINT (num_trimmed == desc->num_trimmed, "%d slots start in trimmed chunks but %d are trimmed\n", num_trimmed, desc->num_trimmed);
 
 	index = desc->anchor.data.avail;
 	last = -1;
-	for (i = 0; i < count; ++i) {
+	for (i = 0; i < num_listed; ++i) {
 		gpointer addr = (char*)desc->sb + index * desc->slot_size;
-		g_assert_OR_PRINT (index >= 0 && index < max_count,
+		g_assert_OR_PRINT (index >= 0 && index < bump,
 				"index %d for %dth available slot, linked from %d, not in range [0 .. %d)\n",
-				index, i, last, max_count);
+				index, i, last, bump);
 		g_assert_OR_PRINT (!linked [index], "%dth available slot %d linked twice\n", i, index);
 		if (linked [index])
 			break;
@@ -561,6 +2596,26 @@ descriptor_check_consistency (Descriptor *desc, gboolean print)
 		last = index;
 		index = *(unsigned int*)addr;
 	}
+	g_assert_OR_PRINT (index == AVAIL_NONE, "free list not terminated after %d slots\n", num_listed);
+
+	count = desc->remote.data.count;
+	index = desc->remote.data.head;
+	last = -1;
+	for (i = 0; i < count; ++i) {
+		g_assert_OR_PRINT (index < bump, "index %d for %dth remote slot, linked from %d, not below %d\n", index, i, last, bump);
+		if (index >= bump)
+			break;
+		g_assert_OR_PRINT (!linked [index], "%dth remote slot %d linked twice\n", i, index);
+		if (linked [index])
+			break;
+		linked [index] = TRUE;
+		last = index;
+		index = *(unsigned int*)SLOT_ADDR (desc, index);
+	}
+	if (count)
+		g_assert_OR_PRINT (last == desc->remote.data.tail, "remote list ends at %d, not its tail %d\n", last, desc->remote.data.tail);
+
+	g_free (linked);
 }
 
 gboolean
@@ -568,24 +2623,95 @@ mono_lock_free_allocator_check_consistency (MonoLockFreeAllocator *heap)
 {
 	Descriptor *active = heap->active;
 	Descriptor *desc;
+	int bin, stripe;
 	if (active) {
 		g_assert (active->anchor.data.state == STATE_PARTIAL);
+		g_assert (active->heap == heap);
 		descriptor_check_consistency (active, FALSE);
 	}
-	while ((desc = (Descriptor*)mono_lock_free_queue_dequeue (&heap->sc->partial))) {
-		g_assert (desc->anchor.data.state == STATE_PARTIAL || desc->anchor.data.state == STATE_EMPTY);
-		descriptor_check_consistency (desc, FALSE);
+	for (bin = 0; bin < MONO_LOCK_FREE_ALLOC_MAX_PARTIAL_BINS; ++bin) {
+		for (stripe = 0; stripe < MONO_LOCK_FREE_ALLOC_MAX_PARTIAL_STRIPES; ++stripe) {
+			while ((desc = (Descriptor*)mono_lock_free_queue_dequeue (PARTIAL_QUEUE (heap->sc, bin, stripe)))) {
+				g_assert (bin < heap->sc->num_partial_bins && stripe < heap->sc->num_partial_stripes);
+				g_assert (desc->anchor.data.state == STATE_PARTIAL || desc->anchor.data.state == STATE_EMPTY);
+				descriptor_check_consistency (desc, FALSE);
+			}
+		}
 	}
 	return TRUE;
 }
 
+/*
+ * SB_SIZE must be a power of two between MONO_LOCK_FREE_ALLOC_SB_MIN_SIZE
+ * and MONO_LOCK_FREE_ALLOC_SB_MAX_SIZE, and large enough to hold at
+ * least two slots.
+ *
+ * If ALIGNMENT is not 0 it must be a power of two that divides
+ * SLOT_SIZE.  The first slot is then placed at the first multiple of
+ * ALIGNMENT after the superblock header, so all slots are aligned to
+ * it, at the cost of leaving a gap after the header.
+ */
 void
-mono_lock_free_allocator_init_size_class (MonoLockFreeAllocSizeClass *sc, unsigned int slot_size)
+mono_lock_free_allocator_init_size_class_aligned (MonoLockFreeAllocSizeClass *sc, unsigned int slot_size, unsigned int sb_size, unsigned int alignment)
 {
-	g_assert (slot_size <= SB_USABLE_SIZE / 2);
+	unsigned int slot_offset = SB_HEADER_SIZE;
+	int i, j;
+
+	g_assert (sb_size >= SB_MIN_SIZE && sb_size <= SB_MAX_SIZE);
+	g_assert (!(sb_size & (sb_size - 1)));
+	/* Free slots hold the index of the next free slot. */
+	g_assert (slot_size >= sizeof (unsigned int));
+
+	if (alignment) {
+		g_assert (!(alignment & (alignment - 1)));
+		g_assert (!(slot_size & (alignment - 1)));
+		slot_offset = (SB_HEADER_SIZE + alignment - 1) & ~(alignment - 1);
+	}
+	g_assert (slot_size <= (sb_size - slot_offset) / 2);
 
-	mono_lock_free_queue_init (&sc->partial);
+	for (i = 0; i < MONO_LOCK_FREE_ALLOC_MAX_PARTIAL_BINS; ++i) {
+		for (j = 0; j < MONO_LOCK_FREE_ALLOC_MAX_PARTIAL_STRIPES; ++j) {
+			mono_lock_free_queue_init (PARTIAL_QUEUE (sc, i, j));
+			PARTIAL_COUNT (sc, i, j) = 0;
+		}
+	}
+	sc->num_partial_bins = 1;
+	sc->num_partial_stripes = 1;
 	sc->slot_size = slot_size;
+	sc->sb_size = sb_size;
+	sc->slot_offset = slot_offset;
+	/* The alignment we get anyway, which might be more than asked for. */
+	sc->alignment = 1 << __builtin_ctz (slot_offset | slot_size);
+	sc->magazine_size = 0;
+	sc->remote_free = FALSE;
+	sc->auto_trim = FALSE;
+	sc->trim_pass = 0;
+	sc->trimming = 0;
+	sc->trim_queue = -1;
+	sc->trim_left = 0;
+	sc->trim_bitmap = NULL;
+
+	sc->index = InterlockedIncrement (&num_size_classes) - 1;
+	g_assert (sc->index < MONO_LOCK_FREE_ALLOC_MAX_SIZE_CLASSES);
+	size_classes [sc->index] = sc;
+}
+
+void
+mono_lock_free_allocator_init_size_class (MonoLockFreeAllocSizeClass *sc, unsigned int slot_size, unsigned int sb_size)
+{
+	mono_lock_free_allocator_init_size_class_aligned (sc, slot_size, sb_size, 0);
+}
+
+/*
+ * A magazine size of 0 disables the per-thread magazines for the size
+ * class.  Slots already in magazines stay there until they are used
+ * or flushed.
+ */
+void
+mono_lock_free_allocator_set_magazine_size (MonoLockFreeAllocSizeClass *sc, unsigned int magazine_size)
+{
+	g_assert (magazine_size <= MONO_LOCK_FREE_ALLOC_MAGAZINE_MAX_SIZE);
+	sc->magazine_size = magazine_size;
 }
 
 void
@@ -593,4 +2719,109 @@ mono_lock_free_allocator_init_allocator (MonoLockFreeAllocator *heap, MonoLockFr
 {
 	heap->sc = sc;
 	heap->active = NULL;
+	heap->per_cpu = NULL;
+}
+
+/*
+ * In remote free mode, slots freed by a thread other than the one that
+ * last allocated from their superblock don't touch the superblock's
+ * anchor.  The mode can be switched at any time.
+ */
+void
+mono_lock_free_allocator_set_remote_free (MonoLockFreeAllocSizeClass *sc, gboolean remote_free)
+{
+	sc->remote_free = remote_free;
+}
+
+/*
+ * Splits the partial queue of SC into NUM_BINS bins by occupancy.
+ * This must happen before anything is allocated from SC.
+ */
+void
+mono_lock_free_allocator_set_partial_bins (MonoLockFreeAllocSizeClass *sc, unsigned int num_bins)
+{
+	g_assert (num_bins >= 1 && num_bins <= MONO_LOCK_FREE_ALLOC_MAX_PARTIAL_BINS);
+	sc->num_partial_bins = num_bins;
+}
+
+/*
+ * Stripes each bin of the partial queue of SC NUM_STRIPES ways, which
+ * spreads the contention on the queues over more cache lines.  This
+ * must happen before anything is allocated from SC.
+ */
+void
+mono_lock_free_allocator_set_partial_stripes (MonoLockFreeAllocSizeClass *sc, unsigned int num_stripes)
+{
+	g_assert (num_stripes >= 1 && num_stripes <= MONO_LOCK_FREE_ALLOC_MAX_PARTIAL_STRIPES);
+	sc->num_partial_stripes = num_stripes;
+}
+
+/*
+ * Sets the high-water mark of the superblock cache, in bytes, and the
+ * time in milliseconds a superblock may stay in the cache unused
+ * before it is returned to the OS.  A MAX_BYTES of 0 disables the
+ * cache.
+ */
+void
+mono_lock_free_allocator_set_sb_cache_limits (size_t max_bytes, unsigned int decay_ms)
+{
+	g_assert (max_bytes <= (1 << 30) && decay_ms <= (1 << 30));
+	sb_cache_max_bytes = max_bytes;
+	sb_cache_decay_ms = decay_ms;
+}
+
+/*
+ * Sets the high-water mark of the large object cache, in bytes.  A
+ * MAX_BYTES of 0 disables the cache.  Cached mappings decay like
+ * cached superblocks.
+ */
+void
+mono_lock_free_allocator_set_large_cache_limit (size_t max_bytes)
+{
+	g_assert (max_bytes <= (1 << 30));
+	large_cache_max_bytes = max_bytes;
+}
+
+/*
+ * Returns superblocks and large mappings that have been in their
+ * caches for longer than the decay interval to the OS.  This happens
+ * automatically as long as superblocks are allocated or retired.
+ */
+void
+mono_lock_free_allocator_decay_sb_cache (void)
+{
+	gint64 now = now_ms ();
+	sb_cache_last_decay = now;
+	sb_cache_release (now, sb_cache_decay_ms);
+	large_cache_release (now, sb_cache_decay_ms);
+	auto_trim ();
+}
+
+/*
+ * If NUM_HEAPS is 0 one heap per configured CPU is created.
+ */
+void
+mono_lock_free_allocator_init_per_cpu (MonoLockFreeAllocPerCpu *per_cpu, MonoLockFreeAllocSizeClass *sc, int num_heaps)
+{
+	int i;
+
+	if (!num_heaps)
+		num_heaps = mono_cpu_count ();
+
+	per_cpu->sc = sc;
+	per_cpu->num_heaps = num_heaps;
+	per_cpu->heaps = mono_sgen_alloc_os_memory (sizeof (MonoLockFreeAllocCpuHeap) * num_heaps, TRUE);
+	g_assert (per_cpu->heaps);
+
+	for (i = 0; i < num_heaps; ++i) {
+		mono_lock_free_allocator_init_allocator (&per_cpu->heaps [i].heap, sc);
+		per_cpu->heaps [i].heap.per_cpu = per_cpu;
+	}
+}
+
+gpointer
+mono_lock_free_alloc_per_cpu (MonoLockFreeAllocPerCpu *per_cpu)
+{
+	int cpu = mono_cpu_current_hint ();
+	return mono_lock_free_alloc (&per_cpu->heaps [cpu % per_cpu->num_heaps].heap);
 }
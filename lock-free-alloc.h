@@ -30,24 +30,186 @@
 
 #include "lock-free-queue.h"
 
+/* Superblock sizes must be powers of two in this range. */
+#define MONO_LOCK_FREE_ALLOC_SB_MIN_SIZE	4096
+#define MONO_LOCK_FREE_ALLOC_SB_MAX_SIZE	(2 * 1024 * 1024)
+#define MONO_LOCK_FREE_ALLOC_SB_DEFAULT_SIZE	16384
+
+#define MONO_LOCK_FREE_ALLOC_SB_HEADER_SIZE	16
+#define MONO_LOCK_FREE_ALLOC_SB_USABLE_SIZE(sb_size)	((sb_size) - MONO_LOCK_FREE_ALLOC_SB_HEADER_SIZE)
+
+/* The maximum number of size classes that can be initialized. */
+#define MONO_LOCK_FREE_ALLOC_MAX_SIZE_CLASSES	64
+
+/* The maximum number of occupancy bins and stripes of the partial queue. */
+#define MONO_LOCK_FREE_ALLOC_MAX_PARTIAL_BINS	8
+#define MONO_LOCK_FREE_ALLOC_MAX_PARTIAL_STRIPES	8
+
+/* The maximum number of slots a per-thread magazine can hold. */
+#define MONO_LOCK_FREE_ALLOC_MAGAZINE_MAX_SIZE	64
+
+#define MONO_LOCK_FREE_ALLOC_CACHE_LINE_SIZE	64
+
+typedef union {
+	struct {
+		MonoLockFreeQueue queue;
+		/* The number of descriptors in the queue, approximately. */
+		volatile gint32 count;
+	} data;
+	char pad [MONO_LOCK_FREE_ALLOC_CACHE_LINE_SIZE];
+} MonoLockFreeAllocPartialQueue;
+
 typedef struct {
-	MonoLockFreeQueue partial;
+	/*
+	 * Partial superblocks, binned by how full they are, fullest
+	 * first, and each bin striped by thread.
+	 */
+	MonoLockFreeAllocPartialQueue partial [MONO_LOCK_FREE_ALLOC_MAX_PARTIAL_BINS] [MONO_LOCK_FREE_ALLOC_MAX_PARTIAL_STRIPES];
+	unsigned int num_partial_bins;
+	unsigned int num_partial_stripes;
 	unsigned int slot_size;
+	unsigned int sb_size;
+	/* Offset of the first slot from the start of the superblock. */
+	unsigned int slot_offset;
+	/* The largest power of two all slots are aligned to. */
+	unsigned int alignment;
+	/* Index into the per-thread state. */
+	int index;
+	/* Capacity of the per-thread magazines, or 0 if disabled. */
+	volatile unsigned int magazine_size;
+	/* Whether frees by non-owning threads go to remote lists. */
+	volatile gboolean remote_free;
+	/* Whether the superblock cache decay also trims this size class. */
+	volatile gboolean auto_trim;
+	/* The number of the current trimming pass. */
+	volatile gint32 trim_pass;
+	/* Nonzero while a thread trims this size class. */
+	volatile gint32 trimming;
+	/* The partial queue the current pass is at, or -1 between passes. */
+	int trim_queue;
+	/* How many more descriptors of that queue the pass looks at. */
+	int trim_left;
+	/* Scratch space for trimming, mapped by the first pass. */
+	gulong *trim_bitmap;
 } MonoLockFreeAllocSizeClass;
 
 struct _MonoLockFreeAllocDescriptor;
+struct _MonoLockFreeAllocPerCpu;
 
 typedef struct {
 	struct _MonoLockFreeAllocDescriptor *active;
 	MonoLockFreeAllocSizeClass *sc;
+	/* The per-CPU heap set this heap belongs to, or NULL. */
+	struct _MonoLockFreeAllocPerCpu *per_cpu;
 } MonoLockFreeAllocator;
 
-void mono_lock_free_allocator_init_size_class (MonoLockFreeAllocSizeClass *sc, unsigned int slot_size) MONO_INTERNAL;
+typedef union {
+	MonoLockFreeAllocator heap;
+	char pad [MONO_LOCK_FREE_ALLOC_CACHE_LINE_SIZE];
+} MonoLockFreeAllocCpuHeap;
+
+/*
+ * One heap per CPU, all sharing the partial queue of one size class.
+ */
+typedef struct _MonoLockFreeAllocPerCpu {
+	MonoLockFreeAllocSizeClass *sc;
+	int num_heaps;
+	MonoLockFreeAllocCpuHeap *heaps;
+} MonoLockFreeAllocPerCpu;
+
+void mono_lock_free_allocator_init_size_class (MonoLockFreeAllocSizeClass *sc, unsigned int slot_size, unsigned int sb_size) MONO_INTERNAL;
+void mono_lock_free_allocator_init_size_class_aligned (MonoLockFreeAllocSizeClass *sc, unsigned int slot_size, unsigned int sb_size, unsigned int alignment) MONO_INTERNAL;
 void mono_lock_free_allocator_init_allocator (MonoLockFreeAllocator *heap, MonoLockFreeAllocSizeClass *sc) MONO_INTERNAL;
 
+void mono_lock_free_allocator_init_per_cpu (MonoLockFreeAllocPerCpu *per_cpu, MonoLockFreeAllocSizeClass *sc, int num_heaps) MONO_INTERNAL;
+
 gpointer mono_lock_free_alloc (MonoLockFreeAllocator *heap) MONO_INTERNAL;
+gpointer mono_lock_free_alloc_per_cpu (MonoLockFreeAllocPerCpu *per_cpu) MONO_INTERNAL;
+gpointer mono_lock_free_alloc_aligned (MonoLockFreeAllocator *heap, unsigned int alignment) MONO_INTERNAL;
 void mono_lock_free_free (gpointer ptr) MONO_INTERNAL;
 
+gpointer mono_lock_free_alloc_large (size_t size) MONO_INTERNAL;
+gpointer mono_lock_free_realloc_large (gpointer ptr, size_t size) MONO_INTERNAL;
+size_t mono_lock_free_usable_size (gpointer ptr) MONO_INTERNAL;
+
+void mono_lock_free_alloc_batch (MonoLockFreeAllocator *heap, gpointer *ptrs, int n) MONO_INTERNAL;
+void mono_lock_free_free_batch (gpointer *ptrs, int n) MONO_INTERNAL;
+
+void mono_lock_free_allocator_set_magazine_size (MonoLockFreeAllocSizeClass *sc, unsigned int magazine_size) MONO_INTERNAL;
+void mono_lock_free_allocator_set_remote_free (MonoLockFreeAllocSizeClass *sc, gboolean remote_free) MONO_INTERNAL;
+void mono_lock_free_allocator_set_partial_bins (MonoLockFreeAllocSizeClass *sc, unsigned int num_bins) MONO_INTERNAL;
+void mono_lock_free_allocator_set_partial_stripes (MonoLockFreeAllocSizeClass *sc, unsigned int num_stripes) MONO_INTERNAL;
+
+void mono_lock_free_allocator_set_sb_cache_limits (size_t max_bytes, unsigned int decay_ms) MONO_INTERNAL;
+void mono_lock_free_allocator_set_large_cache_limit (size_t max_bytes) MONO_INTERNAL;
+void mono_lock_free_allocator_decay_sb_cache (void) MONO_INTERNAL;
+void mono_lock_free_allocator_flush_thread_cache (void) MONO_INTERNAL;
+
+void mono_lock_free_allocator_trim (MonoLockFreeAllocSizeClass *sc) MONO_INTERNAL;
+void mono_lock_free_allocator_set_auto_trim (MonoLockFreeAllocSizeClass *sc, gboolean auto_trim) MONO_INTERNAL;
+
 gboolean mono_lock_free_allocator_check_consistency (MonoLockFreeAllocator *heap) MONO_INTERNAL;
 
+enum {
+	MONO_LOCK_FREE_ALLOC_SB_FULL,
+	MONO_LOCK_FREE_ALLOC_SB_PARTIAL,
+	MONO_LOCK_FREE_ALLOC_SB_EMPTY,
+	MONO_LOCK_FREE_ALLOC_SB_NUM_STATES
+};
+
+/* A snapshot of a superblock, as reported by the heap walk. */
+typedef struct {
+	MonoLockFreeAllocator *heap;
+	gpointer sb;
+	unsigned int sb_size;
+	unsigned int slot_size;
+	int state;
+	unsigned int num_slots;
+	/* Free slots, not counting the ones on the remote list. */
+	unsigned int num_free;
+	/* Free slots in the free list. */
+	unsigned int num_listed;
+	/* Free slots that have never been allocated. */
+	unsigned int num_untouched;
+	/* Free slots whose memory has been given back to the OS. */
+	unsigned int num_trimmed;
+	unsigned int num_remote;
+} MonoLockFreeAllocSbInfo;
+
+typedef void (*MonoLockFreeAllocWalkFunc) (MonoLockFreeAllocSbInfo *info, gpointer user_data);
+
+typedef struct {
+	unsigned int num_sbs [MONO_LOCK_FREE_ALLOC_SB_NUM_STATES];
+	size_t sb_bytes;
+	size_t num_slots;
+	size_t num_free;
+	size_t num_untouched;
+	size_t num_trimmed;
+} MonoLockFreeAllocOccupancy;
+
+void mono_lock_free_allocator_walk (MonoLockFreeAllocSizeClass *sc, MonoLockFreeAllocWalkFunc func, gpointer user_data) MONO_INTERNAL;
+void mono_lock_free_allocator_walk_partition (MonoLockFreeAllocSizeClass *sc, int partition, int num_partitions,
+		MonoLockFreeAllocWalkFunc func, gpointer user_data) MONO_INTERNAL;
+void mono_lock_free_allocator_get_occupancy (MonoLockFreeAllocSizeClass *sc, MonoLockFreeAllocOccupancy *occupancy) MONO_INTERNAL;
+
+#ifdef MONO_LOCK_FREE_ALLOC_STATS
+/*
+ * Counters are per size class.  Allocations and frees count slots
+ * handed out and taken back by the API, including the ones served by
+ * magazines.
+ */
+typedef struct {
+	guint64 allocs;
+	guint64 frees;
+	guint64 sb_allocs;
+	guint64 sb_retires;
+	guint64 partial_gets;
+	guint64 partial_puts;
+	guint64 active_cas_failures;
+	guint64 anchor_cas_retries;
+} MonoLockFreeAllocStats;
+
+void mono_lock_free_allocator_get_stats (MonoLockFreeAllocSizeClass *sc, MonoLockFreeAllocStats *stats) MONO_INTERNAL;
+#endif
+
 #endif
@@ -0,0 +1,174 @@
+/*
+ * lock-free-malloc.c: General purpose front end for the lock free
+ * allocator.
+ *
+ * (C) Copyright 2011 Novell, Inc
+ */
+
+/*
+ * This layers a malloc-style interface over a fixed table of size
+ * classes, each with its own MonoLockFreeAllocSizeClass and a set of
+ * per-CPU heaps.
+ *
+ * Sizes up to 128 bytes are rounded up to a multiple of 16.  Above
+ * that every power of two is divided into four classes, so the
+ * internal fragmentation is bounded by 25%.  The last class is capped
+ * at the largest slot size the allocator supports.  Larger sizes go
+ * to the allocator's large object path.
+ *
+ * Size classes are initialized the first time they are used.
+ *
+ * Reallocation keeps the object where it is as long as the new size
+ * fits into its slot, so shrinking and growing within the slack of
+ * the size class is free.  Large objects are resized by remapping.
+ */
+
+#include <sched.h>
+
+#include "fake-glib.h"
+#include "atomic.h"
+#include "mono-membar.h"
+#include "lock-free-alloc.h"
+
+#include "lock-free-malloc.h"
+
+#define SMALL_GRANULARITY	16
+#define SMALL_MAX_SIZE		128
+#define NUM_SMALL_CLASSES	(SMALL_MAX_SIZE / SMALL_GRANULARITY)
+
+/* Number of classes per power of two above SMALL_MAX_SIZE. */
+#define CLASSES_PER_GROUP	4
+/* log2 (SMALL_MAX_SIZE) */
+#define SMALL_MAX_SIZE_BITS	7
+/* The groups are (128, 256], (256, 512], ..., (4096, 8192]. */
+#define NUM_GROUPS		6
+
+#define NUM_SIZE_CLASSES	(NUM_SMALL_CLASSES + NUM_GROUPS * CLASSES_PER_GROUP)
+
+#define MAX_SLOT_SIZE		(MONO_LOCK_FREE_ALLOC_SB_USABLE_SIZE (MONO_LOCK_FREE_ALLOC_SB_DEFAULT_SIZE) / 2)
+
+enum {
+	CLASS_UNINITIALIZED,
+	CLASS_INITIALIZING,
+	CLASS_INITIALIZED
+};
+
+typedef struct {
+	MonoLockFreeAllocSizeClass sc;
+	MonoLockFreeAllocPerCpu heaps;
+	volatile gint32 state;
+} SizeClass;
+
+static SizeClass size_classes [NUM_SIZE_CLASSES];
+
+static int
+size_to_index (size_t size)
+{
+	size_t s;
+	int bits;
+
+	if (size <= SMALL_MAX_SIZE)
+		return size ? (size - 1) / SMALL_GRANULARITY : 0;
+
+	s = size - 1;
+	bits = (sizeof (unsigned long) * 8 - 1) - __builtin_clzl (s);
+	return NUM_SMALL_CLASSES + (bits - SMALL_MAX_SIZE_BITS) * CLASSES_PER_GROUP
+		+ ((s >> (bits - 2)) & (CLASSES_PER_GROUP - 1));
+}
+
+static unsigned int
+index_to_size (int index)
+{
+	int group, step;
+	unsigned int size;
+
+	if (index < NUM_SMALL_CLASSES)
+		return (index + 1) * SMALL_GRANULARITY;
+
+	group = (index - NUM_SMALL_CLASSES) / CLASSES_PER_GROUP;
+	step = (index - NUM_SMALL_CLASSES) % CLASSES_PER_GROUP;
+	size = (SMALL_MAX_SIZE << group) + (step + 1) * ((SMALL_MAX_SIZE / CLASSES_PER_GROUP) << group);
+
+	return MIN (size, MAX_SLOT_SIZE);
+}
+
+static MonoLockFreeAllocPerCpu*
+size_class_get_heaps (int index)
+{
+	SizeClass *c = &size_classes [index];
+
+	if (c->state == CLASS_INITIALIZED)
+		return &c->heaps;
+
+	if (InterlockedCompareExchange (&c->state, CLASS_INITIALIZING, CLASS_UNINITIALIZED) == CLASS_UNINITIALIZED) {
+		mono_lock_free_allocator_init_size_class (&c->sc, index_to_size (index), MONO_LOCK_FREE_ALLOC_SB_DEFAULT_SIZE);
+		mono_lock_free_allocator_init_per_cpu (&c->heaps, &c->sc, 0);
+		mono_memory_write_barrier ();
+		c->state = CLASS_INITIALIZED;
+	} else {
+		/*
+		 * Initialization is only a handful of stores, so
+		 * waiting for the thread doing it is cheap.
+		 */
+		while (c->state != CLASS_INITIALIZED)
+			sched_yield ();
+		mono_memory_read_barrier ();
+	}
+
+	return &c->heaps;
+}
+
+gpointer
+mono_lock_free_malloc (size_t size)
+{
+	if (size > MAX_SLOT_SIZE)
+		return mono_lock_free_alloc_large (size);
+
+	return mono_lock_free_alloc_per_cpu (size_class_get_heaps (size_to_index (size)));
+}
+
+void
+mono_lock_free_free_any (gpointer ptr)
+{
+	if (!ptr)
+		return;
+
+	mono_lock_free_free (ptr);
+}
+
+/*
+ * Like realloc (): a NULL PTR allocates, a SIZE of 0 frees and returns
+ * NULL.  If the memory can't be resized NULL is returned and PTR is
+ * left alone.
+ */
+gpointer
+mono_lock_free_realloc (gpointer ptr, size_t size)
+{
+	size_t old_size;
+	gpointer new_ptr;
+
+	if (!ptr)
+		return mono_lock_free_malloc (size);
+
+	if (!size) {
+		mono_lock_free_free (ptr);
+		return NULL;
+	}
+
+	old_size = mono_lock_free_usable_size (ptr);
+
+	/* Everything above the largest slot size is a large object. */
+	if (old_size > MAX_SLOT_SIZE) {
+		if (size > MAX_SLOT_SIZE)
+			return mono_lock_free_realloc_large (ptr, size);
+	} else if (size <= old_size) {
+		return ptr;
+	}
+
+	new_ptr = mono_lock_free_malloc (size);
+	if (!new_ptr)
+		return NULL;
+	memcpy (new_ptr, ptr, MIN (size, old_size));
+	mono_lock_free_free (ptr);
+	return new_ptr;
+}
@@ -0,0 +1,17 @@
+/*
+ * lock-free-malloc.h: General purpose front end for the lock free
+ * allocator.
+ *
+ * (C) Copyright 2011 Novell, Inc
+ */
+
+#ifndef __MONO_LOCKFREEMALLOC_H__
+#define __MONO_LOCKFREEMALLOC_H__
+
+#include "fake-glib.h"
+
+gpointer mono_lock_free_malloc (size_t size) MONO_INTERNAL;
+void mono_lock_free_free_any (gpointer ptr) MONO_INTERNAL;
+gpointer mono_lock_free_realloc (gpointer ptr, size_t size) MONO_INTERNAL;
+
+#endif
@@ -53,6 +53,7 @@
 #include "mono-membar.h"
 #include "hazard-pointer.h"
 #include "atomic.h"
+#include "mono-backoff.h"
 
 #include "lock-free-queue.h"
 
@@ -98,8 +99,10 @@ mono_lock_free_queue_node_free (MonoLockFreeQueueNode *node)
 void
 mono_lock_free_queue_enqueue (MonoLockFreeQueue *q, MonoLockFreeQueueNode *node)
 {
+	static MonoBackoffSite backoff_site;
 	MonoThreadHazardPointers *hp = mono_hazard_pointer_get ();
 	MonoLockFreeQueueNode *tail;
+	MonoBackoff backoff;
 
 #ifdef QUEUE_DEBUG
 	g_assert (!node->in_queue);
@@ -109,6 +112,8 @@ mono_lock_free_queue_enqueue (MonoLockFreeQueue *q, MonoLockFreeQueueNode *node)
 
 	g_assert (node->next == FREE_NEXT);
 	node->next = END_MARKER;
+	mono_thread_smr_enter (hp);
+	mono_backoff_init (&backoff, &backoff_site);
 	for (;;) {
 		MonoLockFreeQueueNode *next;
 
@@ -144,13 +149,16 @@ mono_lock_free_queue_enqueue (MonoLockFreeQueue *q, MonoLockFreeQueueNode *node)
 
 		mono_memory_write_barrier ();
 		mono_hazard_pointer_clear (hp, 0);
+		mono_backoff_once (&backoff);
 	}
+	mono_backoff_done (&backoff);
 
 	/* Try to advance tail */
 	InterlockedCompareExchangePointer ((gpointer volatile*)&q->tail, node, tail);
 
 	mono_memory_write_barrier ();
 	mono_hazard_pointer_clear (hp, 0);
+	mono_thread_smr_leave (hp);
 }
 
 static void
@@ -202,6 +210,7 @@ try_reenqueue_dummy (MonoLockFreeQueue *q)
 		return FALSE;
 	}
 
+	dummy->birth_era = mono_thread_hazardous_birth_era ();
 	mono_lock_free_queue_enqueue (q, &dummy->node);
 
 	return TRUE;
@@ -210,9 +219,13 @@ try_reenqueue_dummy (MonoLockFreeQueue *q)
 MonoLockFreeQueueNode*
 mono_lock_free_queue_dequeue (MonoLockFreeQueue *q)
 {
+	static MonoBackoffSite backoff_site;
 	MonoThreadHazardPointers *hp = mono_hazard_pointer_get ();
 	MonoLockFreeQueueNode *head;
+	MonoBackoff backoff;
 
+	mono_thread_smr_enter (hp);
+	mono_backoff_init (&backoff, &backoff_site);
  retry:
 	for (;;) {
 		MonoLockFreeQueueNode *tail, *next;
@@ -244,6 +257,7 @@ mono_lock_free_queue_dequeue (MonoLockFreeQueue *q)
 					if (!is_dummy (q, head) && try_reenqueue_dummy (q))
 						continue;
 
+					mono_thread_smr_leave (hp);
 					return NULL;
 				}
 
@@ -259,7 +273,9 @@ mono_lock_free_queue_dequeue (MonoLockFreeQueue *q)
 
 		mono_memory_write_barrier ();
 		mono_hazard_pointer_clear (hp, 0);
+		mono_backoff_once (&backoff);
 	}
+	mono_backoff_done (&backoff);
 
 	/*
 	 * The head is dequeued now, so we know it's this thread's
@@ -285,12 +301,17 @@ mono_lock_free_queue_dequeue (MonoLockFreeQueue *q)
 		g_assert (q->has_dummy);
 		q->has_dummy = 0;
 		mono_memory_write_barrier ();
-		mono_thread_hazardous_free_or_queue (head, free_dummy, FALSE, TRUE);
-		if (try_reenqueue_dummy (q))
-			goto retry;
-		return NULL;
+		/* Our own critical region would keep the dummy alive. */
+		mono_thread_smr_leave (hp);
+		mono_thread_hazardous_try_free_with_birth (head, ((MonoLockFreeQueueDummy*)head)->birth_era, free_dummy);
+		if (!try_reenqueue_dummy (q))
+			return NULL;
+		mono_thread_smr_enter (hp);
+		goto retry;
 	}
 
+	mono_thread_smr_leave (hp);
+
 	/* The caller must hazardously free the node. */
 	return head;
 }
@@ -42,6 +42,8 @@ struct _MonoLockFreeQueueNode {
 typedef struct {
 	MonoLockFreeQueueNode node;
 	volatile gint32 in_use;
+	/* The era the dummy was last enqueued in. */
+	guint32 birth_era;
 } MonoLockFreeQueueDummy;
 
 #define MONO_LOCK_FREE_QUEUE_NUM_DUMMIES	2
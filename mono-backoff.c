@@ -0,0 +1,28 @@
+#include <sched.h>
+
+#include "mono-backoff.h"
+
+unsigned int mono_backoff_min_limit = 4;
+unsigned int mono_backoff_max_limit = 1024;
+unsigned int mono_backoff_yield_failures = 16;
+
+/*
+ * Sets the limits, in pause iterations, between which backoff windows
+ * grow, and the number of consecutive failures after which a thread
+ * yields instead of spinning.  Not thread safe with respect to
+ * ongoing backoffs, which might see a mix of old and new values.
+ */
+void
+mono_backoff_set_limits (unsigned int min_limit, unsigned int max_limit, unsigned int yield_failures)
+{
+	g_assert (min_limit >= 1 && min_limit <= max_limit);
+	mono_backoff_min_limit = min_limit;
+	mono_backoff_max_limit = max_limit;
+	mono_backoff_yield_failures = yield_failures;
+}
+
+void
+mono_backoff_yield (void)
+{
+	sched_yield ();
+}
@@ -0,0 +1,141 @@
+/*
+ * mono-backoff.h: Backoff for CAS retry loops
+ *
+ * A thread whose CAS fails waits before it retries, for a random
+ * number of pause iterations below a limit that doubles with every
+ * failure, up to a maximum.  Once a thread has failed often enough it
+ * yields the CPU instead, so that a preempted thread that is holding
+ * everybody up gets to run.
+ *
+ * Every retry loop has its own site, which remembers the limit a
+ * thread starts with.  The limit goes up if retries keep failing and
+ * down if a single backoff was enough, so sites without contention
+ * end up retrying almost immediately.  Sites are only written to when
+ * a CAS fails.
+ *
+ * Defining MONO_BACKOFF_DISABLE makes all retries immediate.
+ */
+
+#ifndef __MONO_UTILS_BACKOFF_H__
+#define __MONO_UTILS_BACKOFF_H__
+
+#include "fake-glib.h"
+
+typedef struct {
+	/* The starting limit, in pause iterations, or 0 for the minimum. */
+	volatile unsigned int limit;
+} MonoBackoffSite;
+
+typedef struct {
+	MonoBackoffSite *site;
+	unsigned int limit;
+	unsigned int seed;
+	unsigned int failures;
+} MonoBackoff;
+
+/* The tunables, see mono_backoff_set_limits (). */
+extern unsigned int mono_backoff_min_limit;
+extern unsigned int mono_backoff_max_limit;
+extern unsigned int mono_backoff_yield_failures;
+
+void mono_backoff_set_limits (unsigned int min_limit, unsigned int max_limit, unsigned int yield_failures) MONO_INTERNAL;
+
+void mono_backoff_yield (void) MONO_INTERNAL;
+
+static inline void
+mono_cpu_relax (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__asm__ __volatile__ ("pause" : : : "memory");
+#else
+	__asm__ __volatile__ ("" : : : "memory");
+#endif
+}
+
+#ifndef MONO_BACKOFF_DISABLE
+
+static inline void
+mono_backoff_init (MonoBackoff *backoff, MonoBackoffSite *site)
+{
+	backoff->site = site;
+	backoff->limit = 0;
+	backoff->failures = 0;
+	/* Stack addresses differ between threads, so they make a good seed. */
+	backoff->seed = (unsigned int)((gulong)backoff >> 4) | 1;
+}
+
+/*
+ * Call this after a failed CAS, before retrying.
+ */
+static inline void
+mono_backoff_once (MonoBackoff *backoff)
+{
+	unsigned int i, n;
+
+	if (!backoff->failures++) {
+		backoff->limit = backoff->site->limit;
+		if (backoff->limit < mono_backoff_min_limit)
+			backoff->limit = mono_backoff_min_limit;
+	}
+
+	if (backoff->failures > mono_backoff_yield_failures) {
+		mono_backoff_yield ();
+		return;
+	}
+
+	/* xorshift */
+	backoff->seed ^= backoff->seed << 13;
+	backoff->seed ^= backoff->seed >> 17;
+	backoff->seed ^= backoff->seed << 5;
+
+	n = backoff->seed % backoff->limit + 1;
+	for (i = 0; i < n; ++i)
+		mono_cpu_relax ();
+
+	if (backoff->limit < mono_backoff_max_limit / 2)
+		backoff->limit *= 2;
+	else
+		backoff->limit = mono_backoff_max_limit;
+}
+
+/*
+ * Call this after the CAS succeeded, to adapt the site.
+ */
+static inline void
+mono_backoff_done (MonoBackoff *backoff)
+{
+	MonoBackoffSite *site = backoff->site;
+	unsigned int limit;
+
+	if (!backoff->failures)
+		return;
+
+	limit = site->limit;
+	if (backoff->failures == 1)
+		limit /= 2;
+	else if (limit < mono_backoff_max_limit / 2)
+		limit = limit ? limit * 2 : mono_backoff_min_limit * 2;
+	if (limit != site->limit)
+		site->limit = limit;
+}
+
+#else
+
+static inline void
+mono_backoff_init (MonoBackoff *backoff, MonoBackoffSite *site)
+{
+}
+
+static inline void
+mono_backoff_once (MonoBackoff *backoff)
+{
+}
+
+static inline void
+mono_backoff_done (MonoBackoff *backoff)
+{
+}
+
+#endif
+
+#endif
@@ -0,0 +1,53 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <sched.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define HAVE_RSEQ
+#endif
+#endif
+
+#include "mono-cpu.h"
+
+int
+mono_cpu_count (void)
+{
+	long count = sysconf (_SC_NPROCESSORS_CONF);
+	return count > 0 ? (int)count : 1;
+}
+
+/*
+ * Returns the CPU the calling thread is running on.  The result is
+ * only a hint, because the thread can migrate at any time.
+ *
+ * If the C library has registered a restartable sequences area for
+ * the thread, the kernel keeps the current CPU number up to date in
+ * it, so we can read it without a system call.  Otherwise we fall back
+ * to sched_getcpu().  That's all we use the area for: there are no
+ * restartable critical sections, so callers must not rely on staying
+ * on the CPU.
+ */
+int
+mono_cpu_current_hint (void)
+{
+	int cpu;
+
+#ifdef HAVE_RSEQ
+	if (__rseq_size) {
+		struct rseq *rs = (struct rseq*)((char*)__builtin_thread_pointer () + __rseq_offset);
+		cpu = (int)*(volatile __u32*)&rs->cpu_id;
+		if (cpu >= 0)
+			return cpu;
+	}
+#endif
+
+#ifdef __linux__
+	cpu = sched_getcpu ();
+	if (cpu >= 0)
+		return cpu;
+#endif
+
+	return 0;
+}
@@ -0,0 +1,8 @@
+#ifndef __MONO_UTILS_CPU_H__
+#define __MONO_UTILS_CPU_H__
+
+int mono_cpu_count (void);
+
+int mono_cpu_current_hint (void);
+
+#endif
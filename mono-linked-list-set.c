@@ -18,6 +18,7 @@
 
 /*atomics.*/
 #include "atomic.h"
+#include "mono-backoff.h"
 
 static inline gpointer
 mask (gpointer n, uintptr_t bit)
@@ -30,6 +31,14 @@ get_hazardous_pointer_with_mask (gpointer volatile *pp, MonoThreadHazardPointers
 {
 	gpointer p;
 
+#ifdef MONO_SMR_ERAS
+	/* The era doesn't care about the mark, only the slot does. */
+	p = get_hazardous_pointer (pp, hp, hazard_index);
+	if (hp)
+		mono_hazard_pointer_set (hp, hazard_index, mono_lls_pointer_unmask (p));
+	return p;
+#endif
+
 	for (;;) {
 		/* Get the pointer */
 		p = *pp;
@@ -40,7 +49,12 @@ get_hazardous_pointer_with_mask (gpointer volatile *pp, MonoThreadHazardPointers
 		/* Make it hazardous */
 		mono_hazard_pointer_set (hp, hazard_index, mono_lls_pointer_unmask (p));
 
-		mono_memory_barrier ();
+#ifdef MONO_SMR_EPOCH
+		/* The critical region protects it already. */
+		break;
+#endif
+
+		mono_thread_smr_reader_barrier ();
 
 		/* Check that it's still the same.  If not, try
 		   again. */
@@ -54,6 +68,16 @@ get_hazardous_pointer_with_mask (gpointer volatile *pp, MonoThreadHazardPointers
 	return p;
 }
 
+static inline guint32
+node_birth_era (MonoLinkedListSetNode *node)
+{
+#ifdef MONO_SMR_ERAS
+	return node->birth_era;
+#else
+	return 0;
+#endif
+}
+
 /*
 Initialize @list and will use @free_node_func to release memory.
 If @free_node_func is null the caller is responsible for releasing node memory.
@@ -72,6 +96,9 @@ The nodes next, cur and prev are returned in @hp.
 Returns true if a node with key @key was found.
 This function cannot be called from a signal nor within interrupt context*.
 XXX A variant that works within interrupted is possible if needed.
+With MONO_SMR_EPOCH or MONO_SMR_ERAS the nodes in @hp are only safe to
+use as long as the caller is in a critical region, see
+mono_thread_smr_enter ().
 
 * interrupt context is when the current thread is reposible for another thread
 been suspended at an arbritary point. This is a limitation of our SMR implementation.
@@ -79,10 +106,13 @@ been suspended at an arbritary point. This is a limitation of our SMR implementa
 gboolean
 mono_lls_find (MonoLinkedListSet *list, MonoThreadHazardPointers *hp, uintptr_t key)
 {
+	static MonoBackoffSite backoff_site;
 	MonoLinkedListSetNode *cur, *next;
 	MonoLinkedListSetNode **prev;
 	uintptr_t cur_key;
+	MonoBackoff backoff;
 
+	mono_backoff_init (&backoff, &backoff_site);
 try_again:
 	prev = &list->head;
 
@@ -98,8 +128,10 @@ try_again:
 	cur = get_hazardous_pointer_with_mask ((gpointer*)prev, hp, 1);
 
 	while (1) {
-		if (cur == NULL)
+		if (cur == NULL) {
+			mono_backoff_done (&backoff);
 			return FALSE;
+		}
 		next = get_hazardous_pointer_with_mask ((gpointer*)&cur->next, hp, 0);
 		cur_key = cur->key;
 
@@ -110,12 +142,16 @@ try_again:
 		 */
 		mono_memory_read_barrier ();
 
-		if (*prev != cur)
+		if (*prev != cur) {
+			mono_backoff_once (&backoff);
 			goto try_again;
+		}
 
 		if (!mono_lls_pointer_get_mark (next)) {
-			if (cur_key >= key)
+			if (cur_key >= key) {
+				mono_backoff_done (&backoff);
 				return cur_key == key;
+			}
 
 			prev = &cur->next;
 			mono_hazard_pointer_set (hp, 2, cur);
@@ -126,9 +162,12 @@ try_again:
 				mono_memory_write_barrier ();
 				mono_hazard_pointer_clear (hp, 1);
 				if (list->free_node_func)
-					mono_thread_hazardous_free_or_queue (cur, list->free_node_func, FALSE, TRUE);
-			} else
+					mono_thread_hazardous_free_or_queue_with_birth (cur, node_birth_era (cur),
+							list->free_node_func, FALSE, TRUE);
+			} else {
+				mono_backoff_once (&backoff);
 				goto try_again;
+			}
 		}
 		cur = mono_lls_pointer_unmask (next);
 		mono_hazard_pointer_set (hp, 1, cur);
@@ -145,11 +184,17 @@ This function cannot be called from a signal nor with the world stopped.
 gboolean
 mono_lls_insert (MonoLinkedListSet *list, MonoThreadHazardPointers *hp, MonoLinkedListSetNode *value)
 {
+	static MonoBackoffSite backoff_site;
 	MonoLinkedListSetNode *cur, **prev;
+	MonoBackoff backoff;
+#ifdef MONO_SMR_ERAS
+	value->birth_era = mono_thread_hazardous_birth_era ();
+#endif
 	/*We must do a store barrier before inserting 
 	to make sure all values in @node are globally visible.*/
 	mono_memory_barrier ();
 
+	mono_backoff_init (&backoff, &backoff_site);
 	while (1) {
 		if (mono_lls_find (list, hp, value->key))
 			return FALSE;
@@ -160,8 +205,11 @@ mono_lls_insert (MonoLinkedListSet *list, MonoThreadHazardPointers *hp, MonoLink
 		mono_hazard_pointer_set (hp, 0, value);
 		/* The CAS must happen after setting the hazard pointer. */
 		mono_memory_write_barrier ();
-		if (InterlockedCompareExchangePointer ((volatile gpointer*)prev, value, cur) == cur)
+		if (InterlockedCompareExchangePointer ((volatile gpointer*)prev, value, cur) == cur) {
+			mono_backoff_done (&backoff);
 			return TRUE;
+		}
+		mono_backoff_once (&backoff);
 	}
 }
 
@@ -174,7 +222,11 @@ This function cannot be called from a signal nor with the world stopped.
 gboolean
 mono_lls_remove (MonoLinkedListSet *list, MonoThreadHazardPointers *hp, MonoLinkedListSetNode *value)
 {
+	static MonoBackoffSite backoff_site;
 	MonoLinkedListSetNode *cur, **prev, *next;
+	MonoBackoff backoff;
+
+	mono_backoff_init (&backoff, &backoff_site);
 	while (1) {
 		if (!mono_lls_find (list, hp, value->key))
 			return FALSE;
@@ -185,8 +237,11 @@ mono_lls_remove (MonoLinkedListSet *list, MonoThreadHazardPointers *hp, MonoLink
 
 		g_assert (cur == value);
 
-		if (InterlockedCompareExchangePointer ((volatile gpointer*)&cur->next, mask (next, 1), next) != next)
+		if (InterlockedCompareExchangePointer ((volatile gpointer*)&cur->next, mask (next, 1), next) != next) {
+			mono_backoff_once (&backoff);
 			continue;
+		}
+		mono_backoff_done (&backoff);
 		/* The second CAS must happen before the first. */
 		mono_memory_write_barrier ();
 		if (InterlockedCompareExchangePointer ((volatile gpointer*)prev, next, cur) == cur) {
@@ -194,7 +249,8 @@ mono_lls_remove (MonoLinkedListSet *list, MonoThreadHazardPointers *hp, MonoLink
 			mono_memory_write_barrier ();
 			mono_hazard_pointer_clear (hp, 1);
 			if (list->free_node_func)
-				mono_thread_hazardous_free_or_queue (value, list->free_node_func, FALSE, TRUE);
+				mono_thread_hazardous_free_or_queue_with_birth (value, node_birth_era (value),
+						list->free_node_func, FALSE, TRUE);
 		} else
 			mono_lls_find (list, hp, value->key);
 		return TRUE;
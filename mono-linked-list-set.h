@@ -21,6 +21,9 @@ struct _MonoLinkedListSetNode {
 	/* next must be the first element in this struct! */
 	MonoLinkedListSetNode *next;
 	uintptr_t key;
+#ifdef MONO_SMR_ERAS
+	guint32 birth_era;
+#endif
 };
 
 typedef struct {
@@ -86,6 +89,7 @@ Provides snapshot iteration
 #define MONO_LLS_FOREACH_SAFE(list, element, type) {\
 	MonoThreadHazardPointers *__hp = mono_hazard_pointer_get ();	\
 	MonoLinkedListSetNode *__cur, *__next;	\
+	mono_thread_smr_enter (__hp);	\
 	for (__cur = mono_lls_pointer_unmask (get_hazardous_pointer ((gpointer volatile*)&(list)->head, __hp, 1)); \
 		__cur;	\
 		__cur = mono_lls_info_step (__next, __hp)) {	\
@@ -98,6 +102,7 @@ Provides snapshot iteration
 	}	\
 	mono_hazard_pointer_clear (__hp, 0); \
 	mono_hazard_pointer_clear (__hp, 1); \
+	mono_thread_smr_leave (__hp); \
 }
 
 #endif /* __MONO_SPLIT_ORDERED_LIST_H__ */
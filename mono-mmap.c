@@ -1,4 +1,6 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <errno.h>
 
 #include "mono-mmap.h"
 
@@ -18,3 +20,49 @@ mono_vfree (void *addr, size_t len)
 {
 	munmap (addr, len);
 }
+
+/*
+ * Resizes the mapping at ADDR, moving it if necessary.  Returns NULL
+ * if that is not possible, in which case the old mapping is
+ * unchanged.
+ */
+void*
+mono_vremap (void *addr, size_t old_len, size_t new_len)
+{
+#ifdef MREMAP_MAYMOVE
+	addr = mremap (addr, old_len, new_len, MREMAP_MAYMOVE);
+	if (addr == (void*)-1)
+		return NULL;
+	return addr;
+#else
+	return NULL;
+#endif
+}
+
+#ifdef MADV_FREE
+/* Kernels before 4.5 don't know MADV_FREE. */
+static volatile int madv_free_unsupported;
+#endif
+
+/*
+ * Tells the OS that the contents of the pages in [ADDR, ADDR+LEN) are
+ * no longer needed.  The range stays mapped.  When it is touched again
+ * it reads either as zeroes or, with MADV_FREE, if the OS hasn't taken
+ * the pages yet, as its old contents.  MADV_FREE is cheaper, since the
+ * pages are only taken under memory pressure and need not be faulted
+ * in again otherwise, but until then they still count as resident.
+ */
+void
+mono_vdiscard (void *addr, size_t len)
+{
+#ifdef MADV_FREE
+	if (!madv_free_unsupported) {
+		if (!madvise (addr, len, MADV_FREE) || errno != EINVAL)
+			return;
+		madv_free_unsupported = 1;
+	}
+#endif
+#ifdef MADV_DONTNEED
+	madvise (addr, len, MADV_DONTNEED);
+#endif
+}
@@ -12,4 +12,8 @@ void* mono_valloc (void *addr, size_t len, int prot);
 
 void mono_vfree (void *addr, size_t len);
 
+void* mono_vremap (void *addr, size_t old_len, size_t new_len);
+
+void mono_vdiscard (void *addr, size_t len);
+
 #endif
@@ -41,6 +41,29 @@ mono_sgen_free_os_memory (void *addr, size_t size)
 	total_alloc -= size;
 }
 
+/*
+ * Resize memory returned by mono_sgen_alloc_os_memory (), moving it if
+ * necessary.  Returns NULL if the OS can't do that, in which case the
+ * old memory is still valid.
+ */
+void*
+mono_sgen_realloc_os_memory (void *addr, size_t old_size, size_t new_size)
+{
+	size_t pagesize = getpagesize ();
+	void *ptr;
+
+	old_size += pagesize - 1;
+	old_size &= ~(pagesize - 1);
+	new_size += pagesize - 1;
+	new_size &= ~(pagesize - 1);
+	ptr = mono_vremap (addr, old_size, new_size);
+	if (!ptr)
+		return NULL;
+	/* FIXME: CAS */
+	total_alloc += new_size - old_size;
+	return ptr;
+}
+
 void*
 mono_sgen_alloc_os_memory_aligned (mword size, mword alignment, gboolean activate)
 {
@@ -7,6 +7,7 @@ typedef unsigned long mword;
 
 void* mono_sgen_alloc_os_memory (size_t size, int activate);
 void mono_sgen_free_os_memory (void *addr, size_t size);
+void* mono_sgen_realloc_os_memory (void *addr, size_t old_size, size_t new_size);
 
 void* mono_sgen_alloc_os_memory_aligned (mword size, mword alignment, gboolean activate);
 
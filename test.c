@@ -6,6 +6,7 @@
 #include "hazard-pointer.h"
 #include "atomic.h"
 #include "lock-free-alloc.h"
+#include "lock-free-malloc.h"
 #include "mono-linked-list-set.h"
 
 #ifdef TEST_ALLOC
@@ -30,6 +31,81 @@ typedef struct {
 
 #endif
 
+#ifdef TEST_BATCH
+#define USE_SMR
+
+typedef struct {
+	pthread_t thread;
+	int increment;
+	volatile gboolean have_attached;
+} ThreadData;
+#endif
+
+#ifdef TEST_MALLOC
+#define USE_SMR
+
+typedef struct {
+	pthread_t thread;
+	int increment;
+	volatile gboolean have_attached;
+} ThreadData;
+#endif
+
+#ifdef TEST_BENCH
+#define USE_SMR
+
+typedef struct {
+	pthread_t thread;
+	int increment;
+	volatile gboolean have_attached;
+
+	guint64 num_frees;
+	guint64 free_ns;
+	guint64 free_cache_misses;
+	gboolean have_counter;
+} ThreadData;
+#endif
+
+#ifdef TEST_SMR_BENCH
+#define USE_SMR
+
+typedef struct {
+	pthread_t thread;
+	int increment;
+	volatile gboolean have_attached;
+
+	guint64 num_finds;
+	guint64 find_ns;
+	guint64 num_dequeues;
+	guint64 dequeue_ns;
+} ThreadData;
+#endif
+
+#ifdef TEST_PARTIAL_REUSE
+#define USE_SMR
+
+typedef struct {
+	pthread_t thread;
+	int increment;
+	volatile gboolean have_attached;
+} ThreadData;
+#endif
+
+#ifdef TEST_SCAN_BENCH
+#define USE_SMR
+
+typedef struct {
+	pthread_t thread;
+	int increment;
+	volatile gboolean have_attached;
+
+	guint64 num_retires;
+	guint64 retire_ns;
+	guint64 num_try_frees;
+	guint64 try_free_ns;
+} ThreadData;
+#endif
+
 #ifdef TEST_QUEUE
 #define USE_SMR
 
@@ -84,16 +160,55 @@ attach_and_wait_for_threads_to_attach (ThreadData *data)
 
 #ifdef TEST_ALLOC
 
+#ifndef TEST_SIZE
 #define TEST_SIZE	64
+#endif
+#ifndef TEST_SB_SIZE
+#define TEST_SB_SIZE	MONO_LOCK_FREE_ALLOC_SB_DEFAULT_SIZE
+#endif
 
 static MonoLockFreeAllocSizeClass test_sc;
+#ifdef TEST_PER_CPU
+/* Each thread uses its own heap, so the heaps steal from each other. */
+static MonoLockFreeAllocPerCpu test_per_cpu;
+#define THREAD_HEAP(data)	(&test_per_cpu.heaps [(data) - thread_datas].heap)
+#else
 static MonoLockFreeAllocator test_heap;
+#define THREAD_HEAP(data)	(&test_heap)
+#endif
 
 static void
 init_heap (void)
 {
-	mono_lock_free_allocator_init_size_class (&test_sc, TEST_SIZE);
+#ifdef TEST_ALIGNMENT
+	mono_lock_free_allocator_init_size_class_aligned (&test_sc, TEST_SIZE, TEST_SB_SIZE, TEST_ALIGNMENT);
+#else
+	mono_lock_free_allocator_init_size_class (&test_sc, TEST_SIZE, TEST_SB_SIZE);
+#endif
+#ifdef TEST_PARTIAL_BINS
+	mono_lock_free_allocator_set_partial_bins (&test_sc, TEST_PARTIAL_BINS);
+#endif
+#ifdef TEST_PARTIAL_STRIPES
+	mono_lock_free_allocator_set_partial_stripes (&test_sc, TEST_PARTIAL_STRIPES);
+#endif
+#ifdef TEST_MAGAZINE_SIZE
+	mono_lock_free_allocator_set_magazine_size (&test_sc, TEST_MAGAZINE_SIZE);
+#endif
+#ifdef TEST_REMOTE_FREE
+	mono_lock_free_allocator_set_remote_free (&test_sc, TRUE);
+#endif
+#ifdef TEST_SB_CACHE_DECAY_MS
+	/* A small cache that decays quickly, so superblocks are unmapped concurrently. */
+	mono_lock_free_allocator_set_sb_cache_limits (16 * TEST_SB_SIZE, TEST_SB_CACHE_DECAY_MS);
+#endif
+#ifdef TEST_TRIM
+	mono_lock_free_allocator_set_auto_trim (&test_sc, TRUE);
+#endif
+#ifdef TEST_PER_CPU
+	mono_lock_free_allocator_init_per_cpu (&test_per_cpu, &test_sc, NUM_THREADS);
+#else
 	mono_lock_free_allocator_init_allocator (&test_heap, &test_sc);
+#endif
 }
 
 enum {
@@ -153,6 +268,33 @@ dump_action_logs (void)
 	}
 }
 
+#ifdef TEST_WALK
+static void
+check_sb_info (MonoLockFreeAllocSbInfo *info, gpointer user_data)
+{
+	int *num_sbs = user_data;
+
+	g_assert (info->slot_size == TEST_SIZE);
+	g_assert (info->num_free <= info->num_slots);
+	g_assert (info->num_listed + info->num_untouched + info->num_trimmed == info->num_free);
+	switch (info->state) {
+	case MONO_LOCK_FREE_ALLOC_SB_FULL:
+		g_assert (info->num_free == 0);
+		break;
+	case MONO_LOCK_FREE_ALLOC_SB_PARTIAL:
+		g_assert (info->num_free > 0 && info->num_free < info->num_slots);
+		break;
+	case MONO_LOCK_FREE_ALLOC_SB_EMPTY:
+		g_assert (info->num_free == info->num_slots);
+		break;
+	default:
+		g_assert_not_reached ();
+	}
+
+	++*num_sbs;
+}
+#endif
+
 static void*
 thread_func (void *_data)
 {
@@ -165,6 +307,21 @@ thread_func (void *_data)
 	index = 0;
 	for (i = 0; i < NUM_ITERATIONS; ++i) {
 		gpointer p;
+
+#ifdef TEST_WALK
+		/* Each thread walks its own partition while the others allocate. */
+		if (i % 100000 == 0) {
+			int num_sbs = 0;
+			mono_lock_free_allocator_walk_partition (&test_sc, data - thread_datas, NUM_THREADS, check_sb_info, &num_sbs);
+		}
+#endif
+
+#ifdef TEST_TRIM
+		/* One thread trims explicitly, on top of the automatic trimming. */
+		if (data == thread_datas && i % 10000 == 0)
+			mono_lock_free_allocator_trim (&test_sc);
+#endif
+
 	retry:
 		p = entries [index];
 		if (p) {
@@ -176,7 +333,12 @@ thread_func (void *_data)
 
 			log_action (data, ACTION_FREE, index, p);
 		} else {
-			p = mono_lock_free_alloc (&test_heap);
+#ifdef TEST_ALIGNMENT
+			p = mono_lock_free_alloc_aligned (THREAD_HEAP (data), TEST_ALIGNMENT);
+			g_assert (!((gulong)p & (TEST_ALIGNMENT - 1)));
+#else
+			p = mono_lock_free_alloc (THREAD_HEAP (data));
+#endif
 
 			/*
 			int j;
@@ -222,17 +384,824 @@ static void
 test_init (void)
 {
 	init_heap ();
+#ifdef TEST_PER_CPU
+	mono_lock_free_alloc_per_cpu (&test_per_cpu);
+#else
 	mono_lock_free_alloc (&test_heap);
+#endif
 }
 
 static gboolean
 test_finish (void)
 {
+#ifdef TEST_PER_CPU
+	int i;
+#endif
+
+	mono_lock_free_allocator_flush_thread_cache ();
+
+#ifdef TEST_WALK
+	{
+		MonoLockFreeAllocOccupancy occupancy;
+		mono_lock_free_allocator_get_occupancy (&test_sc, &occupancy);
+		g_print ("superblocks %u full %u partial %u empty, %lu of %lu slots free, %lu trimmed\n",
+				occupancy.num_sbs [MONO_LOCK_FREE_ALLOC_SB_FULL],
+				occupancy.num_sbs [MONO_LOCK_FREE_ALLOC_SB_PARTIAL],
+				occupancy.num_sbs [MONO_LOCK_FREE_ALLOC_SB_EMPTY],
+				(gulong)occupancy.num_free, (gulong)occupancy.num_slots,
+				(gulong)occupancy.num_trimmed);
+		g_assert (occupancy.num_free <= occupancy.num_slots);
+	}
+#endif
+
+#ifdef TEST_PER_CPU
+	for (i = 0; i < test_per_cpu.num_heaps; ++i) {
+		if (!mono_lock_free_allocator_check_consistency (&test_per_cpu.heaps [i].heap))
+			return FALSE;
+	}
+	g_print ("heap consistent\n");
+	return TRUE;
+#else
 	if (mono_lock_free_allocator_check_consistency (&test_heap)) {
 		g_print ("heap consistent\n");
 		return TRUE;
 	}
 	return FALSE;
+#endif
+}
+
+#endif
+
+#ifdef TEST_BATCH
+
+#define TEST_SIZE	64
+
+#define NUM_ENTRIES	64
+#define NUM_ITERATIONS	1000000
+#define MAX_BATCH	256
+
+typedef struct {
+	int n;
+	gpointer ptrs [MAX_BATCH];
+} Batch;
+
+static MonoLockFreeAllocSizeClass test_sc;
+static MonoLockFreeAllocator test_heap;
+
+static Batch *entries [NUM_ENTRIES];
+
+static void
+free_batch (Batch *b, int index)
+{
+	int i;
+
+	for (i = 0; i < b->n; ++i) {
+		g_assert (*(int*)b->ptrs [i] == (index << 10) + i);
+		*(int*)b->ptrs [i] = -1;
+	}
+	mono_lock_free_free_batch (b->ptrs, b->n);
+	g_free (b);
+}
+
+static void*
+thread_func (void *_data)
+{
+	ThreadData *data = _data;
+	int increment = data->increment;
+	int i, j, index;
+
+	attach_and_wait_for_threads_to_attach (data);
+
+	index = 0;
+	for (i = 0; i < NUM_ITERATIONS; ++i) {
+		Batch *b;
+	retry:
+		b = entries [index];
+		if (b) {
+			if (InterlockedCompareExchangePointer ((gpointer * volatile)&entries [index], NULL, b) != b)
+				goto retry;
+			free_batch (b, index);
+		} else {
+			b = g_malloc0 (sizeof (Batch));
+			b->n = (i * 7) % MAX_BATCH + 1;
+			mono_lock_free_alloc_batch (&test_heap, b->ptrs, b->n);
+			for (j = 0; j < b->n; ++j)
+				*(int*)b->ptrs [j] = (index << 10) + j;
+
+			if (InterlockedCompareExchangePointer ((gpointer * volatile)&entries [index], b, NULL) != NULL) {
+				free_batch (b, index);
+				goto retry;
+			}
+		}
+
+		index += increment;
+		while (index >= NUM_ENTRIES)
+			index -= NUM_ENTRIES;
+	}
+
+	return NULL;
+}
+
+static void
+test_init (void)
+{
+	mono_lock_free_allocator_init_size_class (&test_sc, TEST_SIZE, MONO_LOCK_FREE_ALLOC_SB_DEFAULT_SIZE);
+	mono_lock_free_allocator_init_allocator (&test_heap, &test_sc);
+}
+
+static gboolean
+test_finish (void)
+{
+	int i;
+
+	for (i = 0; i < NUM_ENTRIES; ++i) {
+		if (entries [i])
+			free_batch (entries [i], i);
+	}
+
+#ifdef MONO_LOCK_FREE_ALLOC_STATS
+	{
+		MonoLockFreeAllocStats stats;
+		mono_lock_free_allocator_get_stats (&test_sc, &stats);
+		g_print ("allocs %lu frees %lu superblocks %lu/%lu partial %lu/%lu active CAS failures %lu anchor CAS retries %lu\n",
+				(gulong)stats.allocs, (gulong)stats.frees,
+				(gulong)stats.sb_allocs, (gulong)stats.sb_retires,
+				(gulong)stats.partial_gets, (gulong)stats.partial_puts,
+				(gulong)stats.active_cas_failures, (gulong)stats.anchor_cas_retries);
+		g_assert (stats.allocs == stats.frees);
+		g_assert (stats.sb_allocs >= stats.sb_retires);
+	}
+#endif
+
+	if (mono_lock_free_allocator_check_consistency (&test_heap)) {
+		g_print ("heap consistent\n");
+		return TRUE;
+	}
+	return FALSE;
+}
+
+#endif
+
+#ifdef TEST_BENCH
+
+/*
+ * Measures the free path.  All threads allocate from the same heap, so
+ * their slots share descriptors, and then free them again, counting
+ * time and, if the kernel lets us, cache misses for the frees only.
+ * Build with -DDESC_SPLIT_LINES for the cache-line split descriptor
+ * layout.
+ */
+
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define TEST_SIZE	64
+#define NUM_ROUNDS	10000
+#define NUM_SLOTS	256
+
+static MonoLockFreeAllocSizeClass test_sc;
+static MonoLockFreeAllocator test_heap;
+
+static int
+open_cache_miss_counter (void)
+{
+	struct perf_event_attr attr;
+
+	memset (&attr, 0, sizeof (attr));
+	attr.size = sizeof (attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return syscall (__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static guint64
+now_ns (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (guint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void*
+thread_func (void *_data)
+{
+	ThreadData *data = _data;
+	gpointer slots [NUM_SLOTS];
+	int fd = open_cache_miss_counter ();
+	int i, j;
+
+	attach_and_wait_for_threads_to_attach (data);
+
+	data->have_counter = fd >= 0;
+	if (data->have_counter)
+		ioctl (fd, PERF_EVENT_IOC_RESET, 0);
+
+	for (i = 0; i < NUM_ROUNDS; ++i) {
+		guint64 start;
+
+		for (j = 0; j < NUM_SLOTS; ++j) {
+			slots [j] = mono_lock_free_alloc (&test_heap);
+			*(int*)slots [j] = j;
+		}
+
+		start = now_ns ();
+		if (data->have_counter)
+			ioctl (fd, PERF_EVENT_IOC_ENABLE, 0);
+		/* Every other slot first, so consecutive frees hit different slots. */
+		for (j = 0; j < NUM_SLOTS; j += 2)
+			mono_lock_free_free (slots [j]);
+		for (j = 1; j < NUM_SLOTS; j += 2)
+			mono_lock_free_free (slots [j]);
+		if (data->have_counter)
+			ioctl (fd, PERF_EVENT_IOC_DISABLE, 0);
+		data->free_ns += now_ns () - start;
+		data->num_frees += NUM_SLOTS;
+	}
+
+	if (data->have_counter) {
+		guint64 count;
+		if (read (fd, &count, sizeof (count)) == sizeof (count))
+			data->free_cache_misses = count;
+		else
+			data->have_counter = FALSE;
+		close (fd);
+	}
+
+	return NULL;
+}
+
+static void
+test_init (void)
+{
+	mono_lock_free_allocator_init_size_class (&test_sc, TEST_SIZE, MONO_LOCK_FREE_ALLOC_SB_DEFAULT_SIZE);
+	mono_lock_free_allocator_init_allocator (&test_heap, &test_sc);
+}
+
+static gboolean
+test_finish (void)
+{
+	guint64 num_frees = 0, free_ns = 0, misses = 0;
+	gboolean have_counter = TRUE;
+	int i;
+
+	for (i = 0; i < NUM_THREADS; ++i) {
+		num_frees += thread_datas [i].num_frees;
+		free_ns += thread_datas [i].free_ns;
+		misses += thread_datas [i].free_cache_misses;
+		have_counter = have_counter && thread_datas [i].have_counter;
+	}
+
+	g_print ("%lu frees, %.1f ns per free", (gulong)num_frees, (double)free_ns / num_frees);
+	if (have_counter)
+		g_print (", %.3f cache misses per free\n", (double)misses / num_frees);
+	else
+		g_print (", cache miss counter not available\n");
+
+	if (mono_lock_free_allocator_check_consistency (&test_heap)) {
+		g_print ("heap consistent\n");
+		return TRUE;
+	}
+	return FALSE;
+}
+
+#endif
+
+#ifdef TEST_SMR_BENCH
+
+/*
+ * Measures what protecting pointers costs in linked list set lookups
+ * and queue dequeues.  Asymmetric fences are turned on if the kernel
+ * supports them.  Build with -DTEST_NO_MEMBARRIER to compare with
+ * plain fences.
+ */
+
+#include <time.h>
+
+#define NUM_LLS_NODES	64
+#define NUM_QUEUE_NODES	256
+#define NUM_ROUNDS	1000000
+
+typedef struct {
+	MonoLockFreeQueueNode node;
+	int index;
+} BenchQueueNode;
+
+static MonoLinkedListSet list;
+static MonoLinkedListSetNode lls_nodes [NUM_LLS_NODES];
+
+static MonoLockFreeQueue queue;
+static BenchQueueNode queue_nodes [NUM_QUEUE_NODES];
+
+static guint64
+now_ns (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (guint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+requeue_node (gpointer p)
+{
+	BenchQueueNode *node = p;
+	mono_lock_free_queue_node_free (&node->node);
+	mono_lock_free_queue_enqueue (&queue, &node->node);
+}
+
+static void*
+thread_func (void *_data)
+{
+	ThreadData *data = _data;
+	MonoThreadHazardPointers *hp;
+	int index = 0;
+	guint64 start;
+	int i;
+
+	attach_and_wait_for_threads_to_attach (data);
+
+	hp = mono_hazard_pointer_get ();
+
+	start = now_ns ();
+	for (i = 0; i < NUM_ROUNDS; ++i) {
+		gboolean result;
+
+		mono_thread_smr_enter (hp);
+		result = mono_lls_find (&list, hp, index << 2);
+		g_assert (result);
+		mono_hazard_pointer_clear (hp, 0);
+		mono_hazard_pointer_clear (hp, 1);
+		mono_hazard_pointer_clear (hp, 2);
+		mono_thread_smr_leave (hp);
+
+		index += data->increment;
+		while (index >= NUM_LLS_NODES)
+			index -= NUM_LLS_NODES;
+	}
+	data->find_ns = now_ns () - start;
+	data->num_finds = NUM_ROUNDS;
+
+	for (i = 0; i < NUM_ROUNDS; ++i) {
+		BenchQueueNode *node;
+
+		start = now_ns ();
+		node = (BenchQueueNode*)mono_lock_free_queue_dequeue (&queue);
+		data->dequeue_ns += now_ns () - start;
+		++data->num_dequeues;
+
+		if (!node)
+			continue;
+		mono_thread_hazardous_free_or_queue (node, requeue_node, FALSE, TRUE);
+	}
+
+	return NULL;
+}
+
+static void
+test_init (void)
+{
+	MonoThreadHazardPointers *hp = mono_hazard_pointer_get ();
+	int i;
+
+#ifndef TEST_NO_MEMBARRIER
+	mono_thread_smr_set_asymmetric_fences (TRUE);
+#endif
+
+	mono_lls_init (&list, NULL);
+	mono_thread_smr_enter (hp);
+	for (i = 0; i < NUM_LLS_NODES; ++i) {
+		lls_nodes [i].key = i << 2;
+		mono_lls_insert (&list, hp, &lls_nodes [i]);
+	}
+	mono_hazard_pointer_clear (hp, 0);
+	mono_hazard_pointer_clear (hp, 1);
+	mono_hazard_pointer_clear (hp, 2);
+	mono_thread_smr_leave (hp);
+
+	mono_lock_free_queue_init (&queue);
+	for (i = 0; i < NUM_QUEUE_NODES; ++i) {
+		queue_nodes [i].index = i;
+		mono_lock_free_queue_node_init (&queue_nodes [i].node, FALSE);
+		mono_lock_free_queue_enqueue (&queue, &queue_nodes [i].node);
+	}
+}
+
+static gboolean
+test_finish (void)
+{
+	guint64 num_finds = 0, find_ns = 0, num_dequeues = 0, dequeue_ns = 0;
+	int i;
+
+	for (i = 0; i < NUM_THREADS; ++i) {
+		num_finds += thread_datas [i].num_finds;
+		find_ns += thread_datas [i].find_ns;
+		num_dequeues += thread_datas [i].num_dequeues;
+		dequeue_ns += thread_datas [i].dequeue_ns;
+	}
+
+	g_print ("%s fences\n", mono_thread_smr_asymmetric_fences ? "asymmetric" : "symmetric");
+	g_print ("%.1f ns per find, %.1f ns per dequeue\n",
+			(double)find_ns / num_finds, (double)dequeue_ns / num_dequeues);
+
+	return TRUE;
+}
+
+#endif
+
+#ifdef TEST_PARTIAL_REUSE
+
+/*
+ * One thread fills superblocks, another one frees half of the slots of
+ * each and then stays idle.  When the first thread allocates that many
+ * slots again, it must get them from the partial superblocks instead of
+ * mapping new ones.  Idle threads attach first, so that retired lists
+ * would have to grow long before they are scanned.
+ */
+
+#define TEST_SIZE	64
+#define NUM_SBS		100
+#define NUM_IDLE_THREADS	29
+
+enum {
+	PHASE_FILL,
+	PHASE_FILLED,
+	PHASE_FREED,
+	PHASE_DONE
+};
+
+static MonoLockFreeAllocSizeClass test_sc;
+static MonoLockFreeAllocator test_heap;
+
+static gpointer *entries;
+static int num_entries;
+static int slots_per_sb;
+static volatile int phase = PHASE_FILL;
+
+static unsigned int
+count_sbs (gulong *num_free)
+{
+	MonoLockFreeAllocOccupancy occupancy;
+	unsigned int n = 0;
+	int i;
+
+	mono_lock_free_allocator_get_occupancy (&test_sc, &occupancy);
+	for (i = 0; i < MONO_LOCK_FREE_ALLOC_SB_NUM_STATES; ++i)
+		n += occupancy.num_sbs [i];
+	if (num_free)
+		*num_free = occupancy.num_free;
+	return n;
+}
+
+static gboolean
+is_freed_entry (int index)
+{
+	return index % slots_per_sb < slots_per_sb / 2;
+}
+
+static void*
+idle_thread_func (void *data)
+{
+	mono_thread_attach ();
+	return NULL;
+}
+
+static void*
+thread_func (void *_data)
+{
+	ThreadData *data = _data;
+	unsigned int num_sbs, new_num_sbs;
+	gulong num_free;
+	int i;
+
+	attach_and_wait_for_threads_to_attach (data);
+
+	switch (data->increment) {
+	case 1:
+		for (i = 0; i < num_entries; ++i)
+			entries [i] = mono_lock_free_alloc (&test_heap);
+		num_sbs = count_sbs (NULL);
+
+		phase = PHASE_FILLED;
+		while (phase != PHASE_FREED)
+			usleep (1000);
+
+		for (i = 0; i < num_entries; ++i) {
+			if (is_freed_entry (i))
+				entries [i] = mono_lock_free_alloc (&test_heap);
+		}
+		/*
+		 * We allocated exactly what was freed, so every slot is
+		 * in use.  A free slot left over means that a partial
+		 * descriptor was stranded, in some queue or stripe we
+		 * didn't look at, or outside all of them.
+		 */
+		new_num_sbs = count_sbs (&num_free);
+		g_print ("%u superblocks before, %u after, %lu slots free\n", num_sbs, new_num_sbs, num_free);
+		g_assert (new_num_sbs == num_sbs);
+		g_assert (num_free == 0);
+
+		phase = PHASE_DONE;
+		break;
+	case 3:
+		while (phase == PHASE_FILL)
+			usleep (1000);
+
+		for (i = 0; i < num_entries; ++i) {
+			if (is_freed_entry (i))
+				mono_lock_free_free (entries [i]);
+		}
+
+		phase = PHASE_FREED;
+		/* Stay attached, with whatever we retired. */
+		while (phase != PHASE_DONE)
+			usleep (1000);
+		break;
+	}
+
+	return NULL;
+}
+
+static void
+test_init (void)
+{
+	MonoLockFreeAllocOccupancy occupancy;
+	gpointer p;
+	int i;
+
+	mono_lock_free_allocator_init_size_class (&test_sc, TEST_SIZE, MONO_LOCK_FREE_ALLOC_SB_DEFAULT_SIZE);
+#ifdef TEST_PARTIAL_BINS
+	mono_lock_free_allocator_set_partial_bins (&test_sc, TEST_PARTIAL_BINS);
+#endif
+#ifdef TEST_PARTIAL_STRIPES
+	mono_lock_free_allocator_set_partial_stripes (&test_sc, TEST_PARTIAL_STRIPES);
+#endif
+	mono_lock_free_allocator_init_allocator (&test_heap, &test_sc);
+
+	p = mono_lock_free_alloc (&test_heap);
+	mono_lock_free_allocator_get_occupancy (&test_sc, &occupancy);
+	slots_per_sb = occupancy.num_slots;
+	mono_lock_free_free (p);
+
+	num_entries = NUM_SBS * slots_per_sb;
+	entries = g_malloc0 (num_entries * sizeof (gpointer));
+
+	for (i = 0; i < NUM_IDLE_THREADS; ++i) {
+		pthread_t thread;
+		pthread_create (&thread, NULL, idle_thread_func, NULL);
+		pthread_join (thread, NULL);
+	}
+}
+
+static gboolean
+test_finish (void)
+{
+	int i;
+
+	for (i = 0; i < num_entries; ++i)
+		mono_lock_free_free (entries [i]);
+	g_free (entries);
+
+	if (mono_lock_free_allocator_check_consistency (&test_heap)) {
+		g_print ("heap consistent\n");
+		return TRUE;
+	}
+	return FALSE;
+}
+
+#endif
+
+#ifdef TEST_SCAN_BENCH
+
+/*
+ * Measures retiring with a large hazard table.  Lots of short-lived
+ * threads attach first.  Their slots stay in the table, so every scan
+ * has to look at all of them, and so does every try free.  Build with
+ * -DMONO_SMR_NO_SIMD for the scalar scans.
+ */
+
+#include <time.h>
+
+#define NUM_IDLE_THREADS	1020
+#define NUM_ITEMS	1024
+#define NUM_RETIRES	2000000
+#define NUM_TRY_FREES	200000
+
+static int items [NUM_ITEMS];
+
+static guint64
+now_ns (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (guint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+free_item (gpointer p)
+{
+}
+
+static void*
+idle_thread_func (void *data)
+{
+	mono_thread_attach ();
+	return NULL;
+}
+
+static void*
+thread_func (void *_data)
+{
+	ThreadData *data = _data;
+	guint64 start;
+	int i;
+
+	attach_and_wait_for_threads_to_attach (data);
+
+	start = now_ns ();
+	for (i = 0; i < NUM_RETIRES; ++i)
+		mono_thread_hazardous_free_or_queue (&items [i % NUM_ITEMS], free_item, FALSE, TRUE);
+	data->retire_ns = now_ns () - start;
+	data->num_retires = NUM_RETIRES;
+
+	start = now_ns ();
+	for (i = 0; i < NUM_TRY_FREES; ++i)
+		mono_thread_hazardous_try_free (&items [i % NUM_ITEMS], free_item);
+	data->try_free_ns = now_ns () - start;
+	data->num_try_frees = NUM_TRY_FREES;
+
+	return NULL;
+}
+
+static void
+test_init (void)
+{
+	int i;
+
+	for (i = 0; i < NUM_IDLE_THREADS; ++i) {
+		pthread_t thread;
+		pthread_create (&thread, NULL, idle_thread_func, NULL);
+		pthread_join (thread, NULL);
+	}
+}
+
+static gboolean
+test_finish (void)
+{
+	guint64 num_retires = 0, retire_ns = 0, num_try_frees = 0, try_free_ns = 0;
+	int i;
+
+	for (i = 0; i < NUM_THREADS; ++i) {
+		num_retires += thread_datas [i].num_retires;
+		retire_ns += thread_datas [i].retire_ns;
+		num_try_frees += thread_datas [i].num_try_frees;
+		try_free_ns += thread_datas [i].try_free_ns;
+	}
+
+	g_print ("%lu retires, %.1f ns per retire\n", (gulong)num_retires, (double)retire_ns / num_retires);
+	g_print ("%lu try frees, %.1f ns per try free\n", (gulong)num_try_frees, (double)try_free_ns / num_try_frees);
+
+	return TRUE;
+}
+
+#endif
+
+#ifdef TEST_MALLOC
+
+#define NUM_ENTRIES	1024
+#define NUM_ITERATIONS	10000000
+
+#define MAX_TEST_SIZE	8000
+/* Every LARGE_ENTRY_STRIDE-th entry is a large object. */
+#define LARGE_ENTRY_STRIDE	16
+
+static gpointer entries [NUM_ENTRIES];
+
+static size_t
+entry_size (int index)
+{
+	if (!(index % LARGE_ENTRY_STRIDE))
+		return MAX_TEST_SIZE + index * 512;
+	return (index * 97) % MAX_TEST_SIZE + 1;
+}
+
+static void
+fill_entry (gpointer p, int index, int value)
+{
+	size_t size = entry_size (index);
+	((char*)p) [0] = value;
+	((char*)p) [size - 1] = value;
+}
+
+static void
+check_entry (gpointer p, int index)
+{
+	size_t size = entry_size (index);
+	g_assert (((char*)p) [0] == (char)index);
+	g_assert (((char*)p) [size - 1] == (char)index);
+}
+
+static void*
+thread_func (void *_data)
+{
+	ThreadData *data = _data;
+	int increment = data->increment;
+	int i, index;
+
+	attach_and_wait_for_threads_to_attach (data);
+
+	index = 0;
+	for (i = 0; i < NUM_ITERATIONS; ++i) {
+		gpointer p;
+	retry:
+		p = entries [index];
+		if (p) {
+			if (InterlockedCompareExchangePointer ((gpointer * volatile)&entries [index], NULL, p) != p)
+				goto retry;
+			check_entry (p, index);
+			fill_entry (p, index, -1);
+			mono_lock_free_free_any (p);
+		} else {
+			/* Start out small and grow, to move across classes. */
+			p = mono_lock_free_realloc (NULL, entry_size (index) / 2 + 1);
+			g_assert (p);
+			((char*)p) [0] = index;
+			p = mono_lock_free_realloc (p, entry_size (index));
+			g_assert (p);
+			g_assert (((char*)p) [0] == (char)index);
+			fill_entry (p, index, index);
+
+			if (InterlockedCompareExchangePointer ((gpointer * volatile)&entries [index], p, NULL) != NULL) {
+				mono_lock_free_free_any (p);
+				goto retry;
+			}
+		}
+
+		index += increment;
+		while (index >= NUM_ENTRIES)
+			index -= NUM_ENTRIES;
+	}
+
+	return NULL;
+}
+
+static void
+test_init (void)
+{
+	size_t size = MONO_LOCK_FREE_ALLOC_SB_USABLE_SIZE (MONO_LOCK_FREE_ALLOC_SB_DEFAULT_SIZE);
+	char *p = mono_lock_free_malloc (size);
+	int i;
+
+	g_assert (p);
+	for (i = 0; i < size; ++i)
+		p [i] = i;
+
+	p = mono_lock_free_realloc_large (p, size * 64);
+	g_assert (p);
+	for (i = 0; i < size; ++i)
+		g_assert (p [i] == (char)i);
+	p [size * 64 - 1] = 1;
+
+	p = mono_lock_free_realloc_large (p, size);
+	g_assert (p);
+	for (i = 0; i < size; ++i)
+		g_assert (p [i] == (char)i);
+
+	mono_lock_free_free_any (p);
+
+	/* Within the slot, across classes, into and out of the large objects. */
+	p = mono_lock_free_realloc (NULL, 100);
+	for (i = 0; i < 100; ++i)
+		p [i] = i;
+	g_assert (mono_lock_free_realloc (p, 110) == p);
+	g_assert (mono_lock_free_realloc (p, 10) == p);
+	p = mono_lock_free_realloc (p, 1000);
+	g_assert (mono_lock_free_usable_size (p) >= 1000);
+	p = mono_lock_free_realloc (p, size * 4);
+	p = mono_lock_free_realloc (p, size * 16);
+	p = mono_lock_free_realloc (p, 50);
+	for (i = 0; i < 50; ++i)
+		g_assert (p [i] == (char)i);
+	g_assert (!mono_lock_free_realloc (p, 0));
+}
+
+static gboolean
+test_finish (void)
+{
+	int i;
+
+	for (i = 0; i < NUM_ENTRIES; ++i) {
+		if (entries [i]) {
+			check_entry (entries [i], i);
+			mono_lock_free_free_any (entries [i]);
+		}
+	}
+
+	return TRUE;
 }
 
 #endif
@@ -326,7 +1295,7 @@ thread_func (void *_data)
 				 * pointers.  The test will then crash
 				 * sooner or later.
 				 */
-				mono_thread_hazardous_free_or_queue (qe, free_entry);
+				mono_thread_hazardous_free_or_queue (qe, free_entry, FALSE, TRUE);
 				//free_entry (qe);
 			}
 		} else {
@@ -491,6 +1460,8 @@ thread_func (void *_data)
 				MonoLinkedListSetNode *node = malloc (sizeof (MonoLinkedListSetNode));
 				node->key = index << 2;
 
+				mono_thread_smr_enter (hp);
+
 				result = mono_lls_insert (&list, hp, node);
 				g_assert (result);
 
@@ -500,11 +1471,15 @@ thread_func (void *_data)
 				mono_hazard_pointer_clear (hp, 0);
 				mono_hazard_pointer_clear (hp, 1);
 				mono_hazard_pointer_clear (hp, 2);
+
+				mono_thread_smr_leave (hp);
 			}
 		} else if (state == STATE_USED) {
 			if (InterlockedCompareExchange (&entries [index], STATE_FREEING, STATE_USED) == STATE_USED) {
 				MonoLinkedListSetNode *node;
 
+				mono_thread_smr_enter (hp);
+
 				result = mono_lls_find (&list, hp, index << 2);
 				g_assert (result);
 
@@ -521,6 +1496,8 @@ thread_func (void *_data)
 				mono_hazard_pointer_clear (hp, 0);
 				mono_hazard_pointer_clear (hp, 1);
 				mono_hazard_pointer_clear (hp, 2);
+
+				mono_thread_smr_leave (hp);
 			}
 		} else {
 			mono_thread_hazardous_try_free_all ();
@@ -546,7 +1523,7 @@ test_finish (void)
 	MonoLinkedListSetNode *node;
 	int i;
 
-	MONO_LLS_FOREACH ((&list), node)
+	MONO_LLS_FOREACH ((&list), node, MonoLinkedListSetNode*)
 		int index = node->key >> 2;
 		g_assert (index >= 0 && index < NUM_ENTRIES);
 		g_assert (entries [index] == STATE_USED);